@@ -20,4 +20,5 @@
 # THE SOFTWARE.
 
 from _scgi_pie import load_app_from_file
-from .server import WSGIServer, run_once
+from .server import WSGIServer, PreforkServer, SubinterpreterServer, load_application, \
+     run_once, tcp_listen
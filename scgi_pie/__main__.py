@@ -22,6 +22,7 @@
 import argparse
 import importlib
 import os
+import socket
 import sys
 import threading
 
@@ -31,18 +32,76 @@ argp = argparse.ArgumentParser()
 
 proc_argp = argp.add_argument_group(title='Process Options')
 proc_argp.add_argument('--num-threads', '-t', type=int, help="Number of threads to spawn (defaults to 4)", default=4)
+proc_argp.add_argument('--max-threads', type=int, help="Start more threads, up to this many, "
+                       "while all are busy and connections are waiting.  Those beyond --num-threads exit "
+                       "again after --idle-timeout (not with --frontend, --reuseport or --subinterpreters)")
+proc_argp.add_argument('--idle-timeout', type=float, default=30.0, help="Seconds a thread beyond "
+                       "--num-threads may wait for a connection before exiting (defaults to 30)")
+proc_argp.add_argument('--processes', '-p', type=int, default=1, help="Number of worker processes, "
+                       "each with --num-threads threads, forked after loading the application and "
+                       "restarted if they die (defaults to 1, no forking).  Send the master SIGUSR1 for "
+                       "each worker's shared and private memory")
 proc_argp.add_argument('--fd', type=int, help="Use inherited file descriptor as listen socket.  For use with tools such as spawn-fcgi.")
-proc_argp.add_argument('--unix-socket', '--unix', '-s', type=argparse.FileType, help="Bind to Unix domain socket on path")
+proc_argp.add_argument('--unix-socket', '--unix', '-s', help="Bind to Unix domain socket on path")
+proc_argp.add_argument('--tcp', metavar='HOST:PORT', help="Listen on TCP address, HOST may be empty for all interfaces")
+proc_argp.add_argument('--reuseport', action='store_true', help="With --tcp, give each thread its own listen "
+                       "socket with SO_REUSEPORT, so the kernel spreads connections between them instead of "
+                       "all threads waiting on one")
+proc_argp.add_argument('--backlog', type=int, default=socket.SOMAXCONN, help="Listen queue length for "
+                       "--tcp and --unix-socket")
 proc_argp.add_argument('--socket-mode', '-M', type=lambda a: int(a, 8), help="Change Unix domain socket path mode")
 proc_argp.add_argument('--stack-size', type=int, help="Stack size of threads in bytes")
+proc_argp.add_argument('--frontend', action='store_true', help="Accept and read requests in a "
+                       "single event loop thread, and only hand them to the worker threads once read, "
+                       "so slow clients don't tie up workers (Linux only)")
+proc_argp.add_argument('--frontend-body-size', type=int, default=16384, help="Bytes of request body "
+                       "--frontend reads ahead before handing off, at most --buffer-size in all")
+proc_argp.add_argument('--frontend-queue-size', type=int, default=1024, help="Most requests --frontend "
+                       "has read and queued for the worker threads.  Once full it stops accepting until "
+                       "they catch up")
+proc_argp.add_argument('--subinterpreters', action='store_true', help="Run each worker thread in "
+                       "its own subinterpreter with its own GIL, each loading the application itself, so "
+                       "they run in parallel within one process (Python 3.12+, not with --frontend or "
+                       "--processes)")
 proc_argp.add_argument('--pipe', action='store_true', help='Use stdin/stdout for a single request instead of listening on a socket.')
 
 python_argp = argp.add_argument_group(title='Python Options')
 python_argp.add_argument('--add-dirname-to-path', action='store_true', help="Add path of wsgi app to sys.path")
 python_argp.add_argument('--buffering', help="Allow buffering of response output.  "
                          "This violates WSGI spec, but can give a small performance boost")
+python_argp.add_argument('--cork-size', type=int, default=0, help="Gather small response chunks, written "
+                         "in quick succession, into writes of up to this many bytes (and cork TCP sockets)")
+python_argp.add_argument('--cork-delay', type=int, default=10, help="Longest time in milliseconds "
+                         "to hold back response chunks with --cork-size")
 python_argp.add_argument('--buffer-size', type=int, default=32768, help="Maximum size of buffers in bytes")
+python_argp.add_argument('--pool-size', type=int, default=262144, help="Maximum bytes of buffer memory each thread keeps for reuse between requests")
 python_argp.add_argument('--validator', action='store_true', help='Add wsgiref.validator middleware')
+python_argp.add_argument('--lazy-environ', action='store_true', help="Only decode environ values when the application looks them up.  "
+                         "The environ is then a dict subclass, so this is ignored with --validator")
+python_argp.add_argument('--static', metavar='PREFIX=DIR', action='append', default=[],
+                         help="Serve files under URL prefix PREFIX straight from DIR, without calling "
+                         "the application.  Requests for anything but an existing file still go to it.  "
+                         "May be given more than once")
+python_argp.add_argument('--fd-cache-size', type=int, default=512, help="Number of open --static files "
+                         "kept for reuse, shared by all threads (0 disables)")
+python_argp.add_argument('--fd-cache-ttl', type=int, default=2000, help="Milliseconds a cached --static file "
+                         "is trusted before checking it for changes")
+python_argp.add_argument('--response-cache', type=int, default=0, metavar='BYTES', help="Keep GET and HEAD "
+                         "responses marked Cache-Control: public with a max-age in memory, up to this many bytes "
+                         "in total, and answer repeats without calling the application")
+python_argp.add_argument('--response-cache-vary', action='append', default=[], metavar='HEADER',
+                         help="Request header that cached responses may differ on.  May be given more than once")
+python_argp.add_argument('--coalesce', action='store_true', help="Let concurrent identical GET and HEAD "
+                         "requests wait for the first one and get a copy of its response.  Requests with "
+                         "cookies or credentials are left alone, unless given to --response-cache-vary")
+python_argp.add_argument('--compress', action='store_true', help="Compress text-like responses with "
+                         "gzip or deflate when the client accepts it, unless already encoded")
+python_argp.add_argument('--compress-level', type=int, default=6, help="zlib level for --compress, 1 to 9")
+python_argp.add_argument('--compress-min-size', type=int, default=1024, help="Leave responses whose "
+                         "Content-Length is below this many bytes uncompressed")
+python_argp.add_argument('--warmup', metavar='MODULE:FUNCTION', help="Call this with the application "
+                         "once it is loaded, before any requests, and before forking with --processes so "
+                         "whatever it sets up is shared")
 python_argp.add_argument('--module', '-m', help="Load application from module path")
 python_argp.add_argument('application', default=None)
 
@@ -52,6 +111,34 @@ if args.buffer_size < 1024:
     sys.stderr.write("Buffer size is too small.\n")
     sys.exit(1) 
 
+if args.subinterpreters:
+    if not hasattr(scgi_pie, 'SubinterpreterServer') or sys.version_info < (3, 12):
+        sys.stderr.write("--subinterpreters needs Python 3.12 or later.\n")
+        sys.exit(1)
+    if args.frontend or args.processes > 1 or args.pipe or args.max_threads is not None:
+        sys.stderr.write("--subinterpreters can't be used with --frontend, --processes, "
+                         "--max-threads or --pipe.\n")
+        sys.exit(1)
+
+if args.max_threads is not None:
+    if args.max_threads < args.num_threads:
+        sys.stderr.write("--max-threads is less than --num-threads.\n")
+        sys.exit(1)
+    if args.frontend:
+        sys.stderr.write("Warning: ignoring --max-threads option because of --frontend\n")
+    elif args.reuseport:
+        # retiring could leave one of the sockets with nobody accepting on it
+        sys.stderr.write("--max-threads can't be used with --reuseport.\n")
+        sys.exit(1)
+
+static_files = []
+for mount in args.static:
+    prefix, sep, directory = mount.partition('=')
+    if not sep or not prefix.startswith('/') or not directory:
+        sys.stderr.write("Bad --static mount %r, expected PREFIX=DIR.\n" % mount)
+        sys.exit(1)
+    static_files.append((prefix, directory))
+
 #
 # Make/Get a socket
 #
@@ -61,8 +148,6 @@ if args.pipe:
 elif args.fd is not None:
     sock = args.fd
 elif args.unix_socket is not None:
-    import socket
-
     try:
         os.unlink(args.unix_socket)
     except:
@@ -73,6 +158,20 @@ elif args.unix_socket is not None:
 
     if args.socket_mode:
         os.chmod(args.unix_socket, args.socket_mode)
+
+    sock.listen(args.backlog)
+elif args.tcp is not None:
+    host, sep, port = args.tcp.rpartition(':')
+    if not sep or not port.isdigit():
+        sys.stderr.write("Bad --tcp address %r, expected HOST:PORT.\n" % args.tcp)
+        sys.exit(1)
+    host = host.strip('[]') or None
+
+    # the frontend does all the accepting, so it only needs the one
+    count = args.num_threads if args.reuseport and not args.frontend else 1
+    if args.reuseport:
+        count *= max(args.processes, 1)
+    sock = [scgi_pie.tcp_listen(host, int(port), args.reuseport, args.backlog) for i in range(count)]
 else:
     sys.stderr.write("No listener given.\n")
     sys.exit(1) 
@@ -102,26 +201,43 @@ sys.stderr = flushfile(sys.stderr)
 # Load App
 #
 
-if args.module is None:
-    if args.add_dirname_to_path:
-        sys.path.insert(0, os.path.dirname(args.application))
-
-    application = scgi_pie.load_app_from_file(args.application)
-else:
-    if args.add_dirname_to_path:
-        sys.stderr.write("Warning: ignoring --add-dirname-to-path option because app from module")
-
-    m = importlib.import_module(args.module)
-    application = getattr(m, args.application or "application")
+if args.warmup is not None and ':' not in args.warmup:
+    sys.stderr.write("Bad --warmup %r, expected MODULE:FUNCTION.\n" % args.warmup)
+    sys.exit(1)
+
+app_spec = {
+    'path' : args.application,
+    'module' : args.module,
+    'name' : args.application,
+    'add_dirname_to_path' : args.add_dirname_to_path,
+    'warmup' : args.warmup,
+    'validator' : args.validator,
+}
 
+# each subinterpreter loads its own
+if not args.subinterpreters:
+    application = scgi_pie.load_application(app_spec)
 
-if args.validator:
-    from wsgiref.validate import validator
-    application = validator(application)
+# validator insists on an exact dict
+if args.validator and args.lazy_environ:
+    sys.stderr.write("Warning: ignoring --lazy-environ option because of --validator\n")
+    args.lazy_environ = False
 
 kwargs = {
     'allow_buffering' : args.buffering,
-    'buffer_size' : args.buffer_size
+    'buffer_size' : args.buffer_size,
+    'pool_size' : args.pool_size,
+    'lazy_environ' : args.lazy_environ,
+    'cork_size' : args.cork_size,
+    'cork_delay' : args.cork_delay,
+    'static_files' : static_files,
+    'fd_cache_size' : args.fd_cache_size,
+    'fd_cache_ttl' : args.fd_cache_ttl,
+    'response_cache_size' : args.response_cache,
+    'response_cache_vary' : args.response_cache_vary,
+    'coalesce' : args.coalesce,
+    'compress_level' : args.compress_level if args.compress else 0,
+    'compress_min_size' : args.compress_min_size
 }
 
 #
@@ -136,12 +252,26 @@ if sock is None:
 # Create Server
 #
 
-server = scgi_pie.WSGIServer(
-        application,
-        sock,
-        num_threads=args.num_threads,
-        **kwargs
-)
+if args.subinterpreters:
+    server = scgi_pie.SubinterpreterServer(app_spec, sock, num_threads=args.num_threads, **kwargs)
+else:
+    if args.processes > 1:
+        server_class = scgi_pie.PreforkServer
+        kwargs['processes'] = args.processes
+    else:
+        server_class = scgi_pie.WSGIServer
+
+    server = server_class(
+            application,
+            sock,
+            num_threads=args.num_threads,
+            frontend=args.frontend,
+            frontend_body_size=args.frontend_body_size,
+            frontend_queue_size=args.frontend_queue_size,
+            max_threads=args.max_threads,
+            idle_timeout=args.idle_timeout,
+            **kwargs
+    )
 
 #
 # Setup Signals
@@ -156,6 +286,9 @@ signal.signal(signal.SIGPIPE, signal.SIG_IGN)
 signal.signal(signal.SIGINT, handle_signal)
 signal.signal(signal.SIGTERM, handle_signal)
 
+if hasattr(server, 'memory_report'):
+    signal.signal(signal.SIGUSR1, lambda signum, frame: server.memory_report())
+
 #
 # Run
 #
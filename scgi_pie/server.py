@@ -19,44 +19,176 @@
 # OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 # THE SOFTWARE.
 
+import gc
+import importlib
 import signal
+import socket
+import sys
+import time
+import traceback
 from threading import Thread
 import os
 
 import _scgi_pie
 
 class ServerThread(Thread):
-    def __init__(self, app, sock, allow_buffering=False, buffer_size=32768):
+    def __init__(self, app, sock, allow_buffering=False, buffer_size=32768, pool_size=262144,
+                 lazy_environ=False, cork_size=0, cork_delay=10, static_files=(),
+                 fd_cache_size=512, fd_cache_ttl=2000, response_cache_size=0,
+                 response_cache_vary=(), coalesce=False, compress_level=0,
+                 compress_min_size=1024, frontend=None, multithread=True, multiprocess=False,
+                 worker_pool=None):
         self.listen_sock = sock
 
-        self.request = _scgi_pie.Request(app, sock, allow_buffering, buffer_size)
+        self.request = _scgi_pie.Request(app, sock, allow_buffering, buffer_size, pool_size,
+                                         lazy_environ, cork_size, cork_delay, static_files,
+                                         fd_cache_size, fd_cache_ttl, response_cache_size,
+                                         response_cache_vary, coalesce, compress_level,
+                                         compress_min_size, frontend, multithread,
+                                         multiprocess, worker_pool)
 
         Thread.__init__(self)
 
     def run(self):
         self.request.accept_loop()
 
+class FrontendThread(Thread):
+    def __init__(self, sock, buffer_size=32768, body_size=16384, queue_size=1024):
+        self.frontend = _scgi_pie.Frontend(sock, buffer_size, body_size, queue_size)
+
+        Thread.__init__(self)
+
+    def run(self):
+        self.frontend.run()
+
+def listen_fds(socket):
+    """
+    socket, or a list of them, as file descriptors the caller now owns.
+    """
+    if not isinstance(socket, (list, tuple)):
+        socket = [socket]
+    return [s.detach() if hasattr(s, "detach") else s for s in socket]
+
+def load_application(spec):
+    """
+    Load the application described by spec, a dict with either 'path' to
+    a file or 'module' and 'name', and optionally 'add_dirname_to_path',
+    'warmup' ("module:function" called with the application) and
+    'validator'.  Plain data, so it can be handed to a subinterpreter.
+    """
+    if spec.get('module') is None:
+        if spec.get('add_dirname_to_path'):
+            sys.path.insert(0, os.path.dirname(spec['path']))
+
+        application = _scgi_pie.load_app_from_file(spec['path'])
+    else:
+        if spec.get('add_dirname_to_path'):
+            sys.stderr.write("Warning: ignoring --add-dirname-to-path option because app from module")
+
+        m = importlib.import_module(spec['module'])
+        application = getattr(m, spec.get('name') or "application")
+
+    if spec.get('warmup') is not None:
+        module, sep, func = spec['warmup'].partition(':')
+        getattr(importlib.import_module(module), func)(application)
+
+    if spec.get('validator'):
+        from wsgiref.validate import validator
+        application = validator(application)
+
+    return application
+
 class WSGIServer(object):
-    def __init__(self, app, socket, num_threads=4, **kwargs):
-        if hasattr(socket, "detach"):
-            socket = socket.detach()
+    """
+    socket may also be a list of listen sockets, such as from tcp_listen
+    with reuseport, which are then shared out between the threads.
+
+    With max_threads above num_threads, another thread is started whenever
+    all of them are busy and connections are waiting, up to max_threads,
+    and threads beyond num_threads exit after idle_timeout seconds without
+    a connection.  That needs a single listen socket, since a thread
+    retiring could otherwise leave one with nobody accepting.
+    """
+    def __init__(self, app, socket, num_threads=4, frontend=False, frontend_body_size=16384,
+                 frontend_queue_size=1024, max_threads=None, idle_timeout=30.0, **kwargs):
+        self.sockets = listen_fds(socket)
+        self.app = app
+        self.quitting = False
+
+        kwargs.setdefault('multithread', max(num_threads, max_threads or 0) > 1)
+
+        self.frontend_thread = None
+        if frontend:
+            self.frontend_thread = FrontendThread(self.sockets[0], kwargs.get('buffer_size', 32768),
+                                                  frontend_body_size, frontend_queue_size)
+            kwargs['frontend'] = self.frontend_thread.frontend
+
+        # the frontend's workers never wait in accept, so never go idle
+        self.pool = None
+        if max_threads is not None and max_threads > num_threads and not frontend:
+            if len(self.sockets) > 1:
+                raise ValueError("max_threads needs a single listen socket")
+            self.pool = _scgi_pie.WorkerPool(self.sockets, num_threads, max_threads,
+                                             int(idle_timeout * 1000))
+            kwargs['worker_pool'] = self.pool
+        self.kwargs = kwargs
 
-        self.socket = socket
         self.threads = []
+        self.spawned = 0
         for i in range(num_threads):
-            self.threads.append(ServerThread(app, socket, **kwargs))
+            if self.pool is not None:
+                self.pool.reserve()
+            self.threads.append(self.new_thread())
+
+    def new_thread(self):
+        sock = self.sockets[self.spawned % len(self.sockets)]
+        self.spawned += 1
+        return ServerThread(self.app, sock, **self.kwargs)
+
+    def manage_pool(self):
+        while True:
+            wanted = self.pool.wait(100)
+            if wanted is None:
+                break
+
+            self.threads = [thr for thr in self.threads if thr.is_alive()]
+            if wanted:
+                thr = self.new_thread()
+                self.threads.append(thr)
+                thr.start()
+
+                # it may have missed halt()
+                if self.quitting:
+                    thr.request.halt_loop()
 
     def run_forever(self):
+        if self.frontend_thread is not None:
+            self.frontend_thread.start()
+
         for thr in self.threads:
             thr.start()
 
+        if self.pool is not None:
+            self.manage_pool()
+
         for thr in self.threads:
             thr.join()
 
+        if self.frontend_thread is not None:
+            self.frontend_thread.join()
+
     def halt(self):
+        self.quitting = True
+
         oldh = signal.signal(signal.SIGINT, lambda i,f: None)
         signal.pthread_sigmask(signal.SIG_BLOCK, {signal.SIGINT})
 
+        if self.frontend_thread is not None:
+            self.frontend_thread.frontend.halt()
+
+        if self.pool is not None:
+            self.pool.halt()
+
         for thr in self.threads:
             thr.request.halt_loop()
 
@@ -64,15 +196,226 @@ class WSGIServer(object):
         signal.signal(signal.SIGINT, oldh)
 
     def close(self):
-        socket = getattr(self, "socket", None)
-        if socket is not None:
-            os.close(self.socket)
-            self.socket = None
+        sockets = getattr(self, "sockets", None)
+        if sockets is not None:
+            for sock in sockets:
+                os.close(sock)
+            self.sockets = None
+
+    def __del__(self):
+        if self is not None:
+            self.close()
+
+def _subinterpreter_worker(config):
+    application = load_application(config['app'])
+    ServerThread(application, config['socket'], **config['kwargs']).run()
+
+class SubinterpreterThread(Thread):
+    def __init__(self, app_spec, sock, kwargs):
+        config = {'app': app_spec, 'socket': sock, 'kwargs': kwargs}
+        self.script = ("import sys; sys.path[:] = %r; "
+                       "from scgi_pie.server import _subinterpreter_worker; "
+                       "_subinterpreter_worker(%r)" % (sys.path, config))
+        self.interp = _scgi_pie.Subinterpreter()
+
+        Thread.__init__(self)
+
+    def run(self):
+        self.interp.run(self.script)
+
+class SubinterpreterServer(object):
+    """
+    Runs each worker thread in its own subinterpreter with its own GIL
+    (Python 3.12+), so they run Python in parallel without forking.  Each
+    loads the application itself from app_spec, as for load_application.
+    """
+    def __init__(self, app_spec, socket, num_threads=4, **kwargs):
+        if not hasattr(_scgi_pie, 'Subinterpreter'):
+            raise RuntimeError("subinterpreter workers need Python 3.12 or later")
+        if kwargs.get('frontend') is not None:
+            raise ValueError("subinterpreter workers can't share a frontend")
+
+        self.sockets = listen_fds(socket)
+
+        # nothing is shared between workers but the C caches
+        kwargs['multithread'] = False
+        kwargs['multiprocess'] = True
+
+        self.threads = []
+        for i in range(num_threads):
+            sock = self.sockets[i % len(self.sockets)]
+            self.threads.append(SubinterpreterThread(app_spec, sock, kwargs))
+
+    def run_forever(self):
+        for thr in self.threads:
+            thr.start()
+
+        for thr in self.threads:
+            thr.join()
+
+    def halt(self):
+        oldh = signal.signal(signal.SIGINT, lambda i,f: None)
+        signal.pthread_sigmask(signal.SIG_BLOCK, {signal.SIGINT})
+
+        for thr in self.threads:
+            thr.interp.halt()
+
+        signal.pthread_sigmask(signal.SIG_UNBLOCK, {signal.SIGINT})
+        signal.signal(signal.SIGINT, oldh)
+
+    def close(self):
+        sockets = getattr(self, "sockets", None)
+        if sockets is not None:
+            for sock in sockets:
+                os.close(sock)
+            self.sockets = None
 
     def __del__(self):
         if self is not None:
             self.close()
 
-def run_once(app, stdin, stdout, allow_buffering=False, buffer_size=32768):
-    req = _scgi_pie.Request(app, -1, allow_buffering, buffer_size)
+class PreforkServer(object):
+    """
+    Forks processes children from the loaded application, each running a
+    WSGIServer on the inherited listen socket, and replaces any that die.
+    When socket is a list with at least one per process, each child gets
+    its own share of them.
+
+    Before the first fork the heap is collected and frozen, so the garbage
+    collector in the children never writes to the objects they inherited,
+    and those pages stay shared.
+    """
+    def __init__(self, app, socket, processes=2, **kwargs):
+        self.app = app
+        self.sockets = socket if isinstance(socket, (list, tuple)) else [socket]
+        self.processes = processes
+        self.kwargs = kwargs
+        self.kwargs['multiprocess'] = processes > 1
+        self.children = {}
+        self.quitting = False
+
+    def spawn(self, slot):
+        if len(self.sockets) >= self.processes:
+            sockets = self.sockets[slot::self.processes]
+        else:
+            sockets = self.sockets
+
+        pid = os.fork()
+        if pid == 0:
+            status = 1
+            try:
+                gc.enable()
+                signal.signal(signal.SIGUSR1, signal.SIG_IGN)
+                server = WSGIServer(self.app, sockets, **self.kwargs)
+
+                def handle_signal(signum, frame):
+                    server.halt()
+                signal.signal(signal.SIGINT, handle_signal)
+                signal.signal(signal.SIGTERM, handle_signal)
+
+                server.run_forever()
+                status = 0
+            except BaseException:
+                traceback.print_exc()
+            finally:
+                os._exit(status)
+
+        self.children[pid] = (slot, time.monotonic())
+
+    def preload(self):
+        gc.disable()
+        gc.collect()
+        _scgi_pie.malloc_trim()
+        gc.freeze()
+
+    def memory_report(self, out=sys.stderr):
+        for pid in sorted(self.children):
+            usage = memory_usage(pid)
+            if usage is not None:
+                out.write("scgi-pie: worker %d: %.1f MiB shared, %.1f MiB private\n" %
+                          (pid, usage[0] / 1048576.0, usage[1] / 1048576.0))
+
+    def run_forever(self):
+        self.preload()
+
+        for slot in range(self.processes):
+            self.spawn(slot)
+
+        while self.children:
+            try:
+                pid, status = os.wait()
+            except ChildProcessError:
+                break
+
+            child = self.children.pop(pid, None)
+            if child is None or self.quitting:
+                continue
+
+            slot, started = child
+            if os.WIFSIGNALED(status):
+                how = "was killed by signal %d" % os.WTERMSIG(status)
+            else:
+                how = "exited with status %d" % os.WEXITSTATUS(status)
+            sys.stderr.write("scgi-pie: worker %d %s, restarting\n" % (pid, how))
+
+            # don't spin if it dies straight away every time
+            if time.monotonic() - started < 1:
+                time.sleep(1)
+            if not self.quitting:
+                self.spawn(slot)
+
+    def halt(self):
+        self.quitting = True
+        for pid in self.children:
+            try:
+                os.kill(pid, signal.SIGTERM)
+            except ProcessLookupError:
+                pass
+
+def memory_usage(pid):
+    """
+    (shared, private) bytes resident for pid, or None if unknown.
+    """
+    shared = private = 0
+    for name in ('smaps_rollup', 'smaps'):
+        try:
+            with open('/proc/%d/%s' % (pid, name)) as f:
+                for line in f:
+                    if line.startswith(('Shared_Clean:', 'Shared_Dirty:')):
+                        shared += int(line.split()[1]) * 1024
+                    elif line.startswith(('Private_Clean:', 'Private_Dirty:')):
+                        private += int(line.split()[1]) * 1024
+        except (OSError, ValueError):
+            continue
+        return shared, private
+    return None
+
+def tcp_listen(host, port, reuseport=False, backlog=socket.SOMAXCONN):
+    """
+    Listen socket for host and port.  With reuseport, more sockets can
+    be bound to the same address, and the kernel spreads connections
+    between them.
+    """
+    family, type_, proto, _, addr = socket.getaddrinfo(host, port, 0, socket.SOCK_STREAM, 0,
+                                                       socket.AI_PASSIVE)[0]
+    sock = socket.socket(family, type_, proto)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    if reuseport:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+
+    # accepted sockets inherit this, and responses are already gathered up
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    sock.bind(addr)
+    sock.listen(backlog)
+    return sock
+
+def run_once(app, stdin, stdout, allow_buffering=False, buffer_size=32768, pool_size=262144,
+             lazy_environ=False, cork_size=0, cork_delay=10, static_files=(),
+             fd_cache_size=512, fd_cache_ttl=2000, response_cache_size=0,
+             response_cache_vary=(), coalesce=False, compress_level=0, compress_min_size=1024):
+    req = _scgi_pie.Request(app, -1, allow_buffering, buffer_size, pool_size, lazy_environ,
+                            cork_size, cork_delay, static_files, fd_cache_size, fd_cache_ttl,
+                            response_cache_size, response_cache_vary, coalesce, compress_level,
+                            compress_min_size, None, False, True)
     return req.run_once(stdin.fileno(), stdout.fileno())
@@ -16,7 +16,10 @@ setup(
     author_email = 'robin@cornhooves.org',
     packages = ['scgi_pie'],
     ext_modules = [
-        Extension('_scgi_pie', ['src/pie.c', 'src/buffer.c'],
+        Extension('_scgi_pie', ['src/pie.c', 'src/buffer.c', 'src/scgi.c', 'src/static.c', 'src/fdcache.c',
+                   'src/respcache.c', 'src/flight.c', 'src/compress.c', 'src/frontend.c',
+                   'src/workqueue.c', 'src/workerpool.c'],
+                  libraries=['z'],
                   extra_compile_args=extra_compile_args)
     ],
     scripts = ['scripts/scgi-pie'],
@@ -21,25 +21,258 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
 #include "buffer.h"
 
-#define MIN_SIZE                (1024)
+#define CHUNK_SIZE              (4096)
 #define MAX_PERSISTENT_SIZE     (4096)
 #define MAX_SIZE                (2147483647)
+#define IOV_BATCH               (64)
+#define MIN_RESERVE             (1024)
 
 /*
- * Currently we maintain a single buffer.  We realloc to increase the size.
+ * Data is kept in a chain of fixed-size chunks.  Appending only ever fills
+ * the tail chunk or links a new one, so stored data is never moved.  Readers
+ * wanting a contiguous pointer across a chunk boundary get just those bytes
+ * coalesced into the head chunk, and writers are handed the whole chain as
+ * an iovec.
  */
 
 static int pull_data_until(PieBuffer *buf, size_t need);
 
+/*
+ * Chunk Pool
+ *
+ * Chunks are recycled through per-request pools in a few size classes, so
+ * steady traffic stops hitting malloc at all.  The amount retained follows
+ * recent per-request peaks, growing immediately and decaying slowly, and is
+ * capped by max_retained.  Chunks larger than the biggest class bypass the
+ * pool.
+ */
+
+static const size_t pool_class_size[PIE_POOL_CLASSES] = {
+    CHUNK_SIZE, CHUNK_SIZE*4, CHUNK_SIZE*16, CHUNK_SIZE*64
+};
+
+static int pool_class(size_t size) {
+    int i;
+
+    for(i = 0; i < PIE_POOL_CLASSES; i++)
+        if(size <= pool_class_size[i])
+            return i;
+    return -1;
+}
+
+void pie_buffer_pool_init(PieBufferPool *pool, size_t max_retained) {
+    int i;
+
+    for(i = 0; i < PIE_POOL_CLASSES; i++)
+        pool->free[i] = NULL;
+
+    pool->retained = 0;
+    pool->max_retained = max_retained;
+    pool->outstanding = 0;
+    pool->peak = 0;
+    pool->watermark = 0;
+}
+
+static PieBufferChunk *pool_get(PieBufferPool *pool, size_t size) {
+    PieBufferChunk *chunk = NULL;
+    int cls;
+
+    cls = pool_class(size);
+    if(cls >= 0) {
+        size = pool_class_size[cls];
+        chunk = pool->free[cls];
+        if(chunk != NULL) {
+            pool->free[cls] = chunk->next;
+            pool->retained -= size;
+        }
+    }
+
+    if(chunk == NULL) {
+        chunk = malloc(sizeof(PieBufferChunk) + size);
+        if(chunk == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        chunk->size = size;
+    }
+
+    pool->outstanding += size;
+    if(pool->outstanding > pool->peak)
+        pool->peak = pool->outstanding;
+
+    return chunk;
+}
+
+static void pool_put(PieBufferPool *pool, PieBufferChunk *chunk) {
+    int cls;
+
+    pool->outstanding -= chunk->size;
+
+    cls = pool_class(chunk->size);
+    if(cls >= 0 && pool_class_size[cls] == chunk->size &&
+       pool->retained + chunk->size <= pool->max_retained) {
+        chunk->next = pool->free[cls];
+        pool->free[cls] = chunk;
+        pool->retained += chunk->size;
+    } else {
+        free(chunk);
+    }
+}
+
+void pie_buffer_pool_trim(PieBufferPool *pool) {
+    PieBufferChunk *chunk;
+    size_t target;
+    int i;
+
+    if(pool->peak >= pool->watermark)
+        pool->watermark = pool->peak;
+    else
+        pool->watermark -= (pool->watermark - pool->peak) / 8;
+
+    target = pool->watermark;
+    if(target > pool->max_retained)
+        target = pool->max_retained;
+
+    /* drop the biggest chunks first */
+    for(i = PIE_POOL_CLASSES - 1; i >= 0 && pool->retained > target; i--) {
+        while(pool->retained > target && (chunk = pool->free[i]) != NULL) {
+            pool->free[i] = chunk->next;
+            pool->retained -= chunk->size;
+            free(chunk);
+        }
+    }
+
+    pool->peak = pool->outstanding;
+}
+
+void pie_buffer_pool_free(PieBufferPool *pool) {
+    size_t max_retained = pool->max_retained;
+    PieBufferChunk *chunk;
+    int i;
+
+    for(i = 0; i < PIE_POOL_CLASSES; i++) {
+        while((chunk = pool->free[i]) != NULL) {
+            pool->free[i] = chunk->next;
+            free(chunk);
+        }
+    }
+
+    pie_buffer_pool_init(pool, max_retained);
+}
+
+/*
+ * Chunks
+ */
+
+static PieBufferChunk *chunk_new(PieBuffer *buffer, size_t size) {
+    PieBufferChunk *chunk;
+
+    if(buffer->pool != NULL) {
+        chunk = pool_get(buffer->pool, size);
+        if(chunk == NULL)
+            return NULL;
+    } else {
+        chunk = malloc(sizeof(PieBufferChunk) + size);
+        if(chunk == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        chunk->size = size;
+    }
+
+    chunk->next = NULL;
+    chunk->start = 0;
+    chunk->end = 0;
+
+    return chunk;
+}
+
+static void chunk_free(PieBuffer *buffer, PieBufferChunk *chunk) {
+    if(buffer->pool != NULL)
+        pool_put(buffer->pool, chunk);
+    else
+        free(chunk);
+}
+
+/*
+ * Buffer
+ */
+
+/*
+ * Release chunks which have been completely read.  The last chunk is kept
+ * and rewound, since it will just be refilled.
+ */
+static void drop_consumed(PieBuffer *buffer) {
+    PieBufferChunk *chunk;
+
+    while((chunk = buffer->head) != NULL && chunk->start == chunk->end) {
+        if(chunk->next == NULL) {
+            chunk->start = chunk->end = 0;
+            break;
+        }
+
+        buffer->head = chunk->next;
+        chunk_free(buffer, chunk);
+    }
+}
+
+static int push_chain(PieBuffer *buffer, const char *data, size_t len) {
+    struct iovec iov[IOV_BATCH];
+    PieBufferChunk *chunk;
+    ssize_t result;
+    int iovcnt = 0;
+
+    for(chunk = buffer->head; chunk != NULL; chunk = chunk->next) {
+        if(chunk->start == chunk->end)
+            continue;
+
+        if(iovcnt == IOV_BATCH) {
+            result = (*buffer->writer)(buffer, iov, iovcnt, buffer->writer_udata);
+            if(result < 0)
+                return -1;
+            iovcnt = 0;
+        }
+
+        iov[iovcnt].iov_base = chunk->data + chunk->start;
+        iov[iovcnt].iov_len = chunk->end - chunk->start;
+        iovcnt++;
+    }
+
+    if(len > 0) {
+        if(iovcnt == IOV_BATCH) {
+            result = (*buffer->writer)(buffer, iov, iovcnt, buffer->writer_udata);
+            if(result < 0)
+                return -1;
+            iovcnt = 0;
+        }
+
+        iov[iovcnt].iov_base = (char *)data;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+    }
+
+    result = (*buffer->writer)(buffer, iov, iovcnt, buffer->writer_udata);
+    return result < 0 ? -1 : 0;
+}
+
 int pie_buffer_init(PieBuffer *buffer) {
-    buffer->buffer = NULL;
-    buffer->buffer_size = 0;
+    buffer->pool = NULL;
+    buffer->head = NULL;
+    buffer->tail = NULL;
+    buffer->data_size = 0;
     buffer->max_size = MAX_SIZE;
     
     buffer->reader = NULL;
@@ -48,28 +281,36 @@ int pie_buffer_init(PieBuffer *buffer) {
     buffer->writer = NULL;
     buffer->writer_udata = NULL;
 
-    pie_buffer_restart(buffer);
-    
     return 0;
 }
 
 void pie_buffer_free_data(PieBuffer *buffer) {
-    if(buffer->buffer != NULL)
-        free(buffer->buffer);
-    buffer->buffer = NULL;
-    buffer->offset = 0;
+    PieBufferChunk *chunk, *next;
+
+    for(chunk = buffer->head; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        chunk_free(buffer, chunk);
+    }
+
+    buffer->head = NULL;
+    buffer->tail = NULL;
     buffer->data_size = 0;
-    buffer->buffer_size = 0;
 }
 
 void pie_buffer_restart(PieBuffer *buffer) {    
-    buffer->offset = 0;
-    buffer->data_size = 0;
-    
-    if(buffer->buffer_size > MAX_PERSISTENT_SIZE) {
-        buffer->buffer_size = 0;
-        free(buffer->buffer);
-        buffer->buffer = NULL;
+    PieBufferChunk *head = buffer->head;
+
+    /* pooled chunks are kept by the pool instead */
+    if(buffer->pool == NULL && head != NULL && head->size <= MAX_PERSISTENT_SIZE) {
+        /* keep a single small chunk around for the next request */
+        buffer->head = head->next;
+        head->next = NULL;
+        head->start = head->end = 0;
+
+        pie_buffer_free_data(buffer);
+        buffer->head = buffer->tail = head;
+    } else {
+        pie_buffer_free_data(buffer);
     }
 }
 
@@ -82,29 +323,34 @@ void pie_buffer_set_maxsize(PieBuffer *buffer, size_t sz) {
     buffer->max_size = sz;
 }
 
+void pie_buffer_set_pool(PieBuffer *buffer, PieBufferPool *pool) {
+    pie_buffer_free_data(buffer);
+    buffer->pool = pool;
+}
+
 void pie_buffer_set_writer(PieBuffer *buffer, buffer_push_data *func, void *udata) {
     buffer->writer = func;
     buffer->writer_udata = udata;
 }
 
 ssize_t pie_buffer_recv(PieBuffer *buffer, int fd, size_t len) {
-    char s[2048];
     ssize_t justread;
+    size_t avail;
+    char *p;
     
     if(len == 0)
-        len = sizeof(s);
+        len = CHUNK_SIZE;
 
     while(len > 0) {
-        if(len > sizeof(s))
-            justread = sizeof(s);
-        else
-            justread = len;
+        p = pie_buffer_reserve(buffer, len, &avail);
+        if(p == NULL)
+            return -1;
 
-        justread = recv(fd, s, justread, 0);
+        justread = recv(fd, p, avail, 0);
         if(justread > 0) {
-            pie_buffer_append(buffer, s, justread);
+            pie_buffer_commit(buffer, justread);
             len -= justread;
-        } else if(errno != EINTR) {
+        } else if(justread == 0 || errno != EINTR) {
             return justread;
         }
     }
@@ -118,15 +364,17 @@ ssize_t pie_buffer_send(PieBuffer *buffer, int fd, size_t len) {
 
     pull_data_until(buffer, len);
     
-    if(buffer->data_size - buffer->offset == 0)
+    if(buffer->data_size == 0)
         return 0;
 
-    if(buffer->offset + len > buffer->data_size)
-        len = buffer->data_size - buffer->offset + 1;
+    if(len > buffer->data_size)
+        len = buffer->data_size;
 
     while(len > 0) {
-        char *p = buffer->buffer + buffer->offset;
-        justsent = send(fd, p, len, 0);
+        PieBufferChunk *chunk = buffer->head;
+        size_t avail = chunk->end - chunk->start;
+
+        justsent = send(fd, chunk->data + chunk->start, len < avail ? len : avail, 0);
         if(justsent <= 0) {
             if(justsent < 0 && errno == EINTR)
                 continue;
@@ -137,103 +385,169 @@ ssize_t pie_buffer_send(PieBuffer *buffer, int fd, size_t len) {
 
         total += justsent;
         len -= justsent;
-        buffer->offset += justsent;
+        pie_buffer_consume(buffer, justsent);
     }
 
     return total;
 }
 
 int pie_buffer_append(PieBuffer *buffer, const char *data, size_t len) {
-    size_t newlen;
-    int i;
+    PieBufferChunk *chunk;
+    size_t n;
     
     if(len == 0 || data == NULL)
         return 0;
 
-    /* move data to beginning of buffer */
-    if(buffer->buffer != NULL && buffer->offset > 0 && len+buffer->offset>=buffer->buffer_size) {
-        memmove(buffer->buffer,
-                buffer->buffer+buffer->offset,
-                buffer->data_size-buffer->offset);
-    
-        buffer->data_size -= buffer->offset;
-        buffer->offset = 0;
-    }
-    
-    /* we'll overflow our maximum limits */
-    if(len >= buffer->max_size - buffer->data_size) {
+    drop_consumed(buffer);
+
+    /* we'll overflow our maximum limits, so push everything out at once */
+    if(len > buffer->max_size - buffer->data_size) {
         if(buffer->writer != NULL) {
-            /* push all of current buffer */
-            if(buffer->data_size > 0) {
-                (*buffer->writer)(buffer,
-                                  buffer->buffer+buffer->offset,
-                                  buffer->data_size,
-                                  buffer->writer_udata);
-                buffer->offset = 0;
-                buffer->data_size = 0;
-            }
-            
-            /*
-             * We have to push part of incoming data as well.  Push
-             * blocks until we reach final block, and buffer that.
-             * 
-             * If we don't have to push any data, just fall through
-             */
-            if(len >= buffer->max_size) {
-                for(i = 0; len - i > buffer->max_size; i += buffer->max_size) {
-                    (*buffer->writer)(buffer,
-                                 data + i,
-                                 buffer->max_size,
-                                 buffer->writer_udata);
-                }
-                
-                /* adjust and fall through to buffer remaining */
-                data = data + i;
-                len = len - i;
-            }
+            int result = push_chain(buffer, data, len);
+            pie_buffer_consume(buffer, buffer->data_size);
+            return result;
         } else {
             errno = ENOMEM;
             return -1;
         }
     }
-    
-    /* resize space */
-    newlen = buffer->data_size + len;
-    if(newlen >= buffer->buffer_size) {
-        size_t newsize = ((len + buffer->data_size)/MIN_SIZE + 1)*MIN_SIZE;
-        char *newbuf = realloc(buffer->buffer, newsize);
 
-        if(newbuf == NULL) {
-            errno = ENOMEM;
-            return -1;
+    while(len > 0) {
+        chunk = buffer->tail;
+        if(chunk == NULL || chunk->end == chunk->size) {
+            chunk = chunk_new(buffer, CHUNK_SIZE);
+            if(chunk == NULL)
+                return -1;
+
+            if(buffer->tail != NULL)
+                buffer->tail->next = chunk;
+            else
+                buffer->head = chunk;
+            buffer->tail = chunk;
         }
 
-        buffer->buffer = newbuf;
-        buffer->buffer_size = newsize;
-    }  
-    
-    /* store */
-    memcpy(buffer->buffer + buffer->data_size, data, len);
-    buffer->data_size = newlen;
+        n = chunk->size - chunk->end;
+        if(n > len)
+            n = len;
+
+        memcpy(chunk->data + chunk->end, data, n);
+        chunk->end += n;
+        buffer->data_size += n;
+
+        data += n;
+        len -= n;
+    }
     
     return 0;
 }
 
+/*
+ * Hand out free space at the end of the buffer so data can be read straight
+ * into it.  Up to len bytes are offered (*avail says how many); reuse the
+ * tail chunk unless it is nearly full, otherwise link a chunk big enough
+ * for the whole request.  Nothing is stored until pie_buffer_commit().
+ */
+char *pie_buffer_reserve(PieBuffer *buffer, size_t len, size_t *avail) {
+    PieBufferChunk *chunk;
+    size_t n;
+
+    drop_consumed(buffer);
+
+    if(buffer->data_size >= buffer->max_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if(len == 0)
+        len = CHUNK_SIZE;
+    if(len > buffer->max_size - buffer->data_size)
+        len = buffer->max_size - buffer->data_size;
+
+    chunk = buffer->tail;
+    n = chunk != NULL ? chunk->size - chunk->end : 0;
+    if(n < len && n < MIN_RESERVE) {
+        chunk = chunk_new(buffer, len > CHUNK_SIZE ? len : CHUNK_SIZE);
+        if(chunk == NULL)
+            return NULL;
+
+        if(buffer->tail != NULL)
+            buffer->tail->next = chunk;
+        else
+            buffer->head = chunk;
+        buffer->tail = chunk;
+
+        n = chunk->size;
+    }
+
+    *avail = n < len ? n : len;
+    return chunk->data + chunk->end;
+}
+
+void pie_buffer_commit(PieBuffer *buffer, size_t len) {
+    buffer->tail->end += len;
+    buffer->data_size += len;
+}
+
 int pie_buffer_flush(PieBuffer *buffer) {
     int result = -1;
 
-    if(buffer->writer != NULL) {    
-        result = (*buffer->writer)(buffer, 
-                                  buffer->buffer+buffer->offset,
-                                  buffer->data_size,
-                                  buffer->writer_udata);
-    }
-    buffer->offset = 0;
-    buffer->data_size = 0;
+    if(buffer->writer != NULL)
+        result = push_chain(buffer, NULL, 0);
+
+    pie_buffer_consume(buffer, buffer->data_size);
+
+    return result;
+}
+
+/*
+ * Flush, with data written straight after whatever was buffered, in the
+ * same writer call and without copying it into the buffer first.
+ */
+int pie_buffer_flush_with(PieBuffer *buffer, const char *data, size_t len) {
+    int result = -1;
+
+    if(buffer->writer != NULL)
+        result = push_chain(buffer, data, len);
+
+    pie_buffer_consume(buffer, buffer->data_size);
 
     return result;
 }
 
+int pie_buffer_get_iov(PieBuffer *buffer, struct iovec *iov, int iovcnt) {
+    PieBufferChunk *chunk;
+    int i = 0;
+
+    for(chunk = buffer->head; chunk != NULL && i < iovcnt; chunk = chunk->next) {
+        if(chunk->start == chunk->end)
+            continue;
+
+        iov[i].iov_base = chunk->data + chunk->start;
+        iov[i].iov_len = chunk->end - chunk->start;
+        i++;
+    }
+
+    return i;
+}
+
+void pie_buffer_consume(PieBuffer *buffer, size_t len) {
+    PieBufferChunk *chunk;
+    size_t n;
+
+    if(len > buffer->data_size)
+        len = buffer->data_size;
+
+    for(chunk = buffer->head; chunk != NULL && len > 0; chunk = chunk->next) {
+        n = chunk->end - chunk->start;
+        if(n > len)
+            n = len;
+
+        chunk->start += n;
+        buffer->data_size -= n;
+        len -= n;
+    }
+}
+
 static int pull_data(PieBuffer *buf) {
     if(buf->reader != NULL) {
         return (*buf->reader)(buf, buf->reader_udata);
@@ -243,86 +557,244 @@ static int pull_data(PieBuffer *buf) {
 }
 
 static int pull_data_until(PieBuffer *buf, size_t need) {
-    while(need > buf->data_size - buf->offset)
+    while(need > buf->data_size)
         if(pull_data(buf) < 0)
             return -1;
     return 0;
 }
 
+/*
+ * Make the first len unread bytes contiguous in the head chunk, copying
+ * only what is needed from the chunks that follow.
+ */
+static int linearize(PieBuffer *buffer, size_t len) {
+    PieBufferChunk *head, *chunk;
+    size_t n;
+
+    drop_consumed(buffer);
+
+    head = buffer->head;
+    if(head->end - head->start >= len)
+        return 0;
+
+    if(head->size - head->start < len) {
+        chunk = chunk_new(buffer, len > CHUNK_SIZE ? len : CHUNK_SIZE);
+        if(chunk == NULL)
+            return -1;
+
+        n = head->end - head->start;
+        memcpy(chunk->data, head->data + head->start, n);
+        chunk->end = n;
+        chunk->next = head->next;
+
+        if(buffer->tail == head)
+            buffer->tail = chunk;
+        buffer->head = chunk;
+        chunk_free(buffer, head);
+
+        head = chunk;
+    }
+
+    while(head->end - head->start < len) {
+        chunk = head->next;
+
+        n = len - (head->end - head->start);
+        if(n > chunk->end - chunk->start)
+            n = chunk->end - chunk->start;
+
+        memcpy(head->data + head->end, chunk->data + chunk->start, n);
+        head->end += n;
+        chunk->start += n;
+
+        if(chunk->start == chunk->end) {
+            head->next = chunk->next;
+            if(buffer->tail == chunk)
+                buffer->tail = head;
+            chunk_free(buffer, chunk);
+        }
+    }
+
+    return 0;
+}
+
 int pie_buffer_getchar(PieBuffer *buffer) {
+    PieBufferChunk *chunk;
+
     pull_data_until(buffer, 1);
 
-    if(buffer->buffer != NULL && buffer->offset <= buffer->data_size) {
-        return buffer->buffer[buffer->offset++];
-    }
-    return -1;
+    if(buffer->data_size == 0)
+        return -1;
+
+    drop_consumed(buffer);
+    chunk = buffer->head;
+
+    buffer->data_size--;
+    return (unsigned char)chunk->data[chunk->start++];
 }
 
 size_t pie_buffer_size(PieBuffer *buffer) {
-    return buffer->data_size - buffer->offset;
+    return buffer->data_size;
 }
 
 ssize_t pie_buffer_unget(PieBuffer *buffer, size_t len) {
-    if(buffer->offset + len > buffer->data_size) {
+    if(buffer->head == NULL || buffer->head->start < len) {
         errno = EINVAL;
         return -1;
     }
 
-    buffer->offset -= len;
+    buffer->head->start -= len;
+    buffer->data_size += len;
 
     return 0;
 }
 
 ssize_t pie_buffer_getptr(PieBuffer *buffer, char **p, size_t len) {
+    PieBufferChunk *chunk;
+
     pull_data_until(buffer, len);
     
-    if(buffer->data_size - buffer->offset == 0)
+    if(buffer->data_size == 0)
         return 0;
     
-    if(buffer->offset + len > buffer->data_size)
-        len = buffer->data_size - buffer->offset + 1;
-    *p = buffer->buffer + buffer->offset;
-    buffer->offset += len;
+    if(len > buffer->data_size)
+        len = buffer->data_size;
+
+    if(linearize(buffer, len) < 0)
+        return -1;
+
+    chunk = buffer->head;
+    *p = chunk->data + chunk->start;
+    chunk->start += len;
+    buffer->data_size -= len;
     
     return len;
 }
 
-ssize_t pie_buffer_findchar(PieBuffer *buffer, char c, size_t hint) {
-    size_t base;
-    size_t i;
-    
+/*
+ * Searching
+ *
+ * Scanners look for a newline between p and end and return NULL if it
+ * isn't there.  Single characters go through memchr, which libc already
+ * vectorizes.  Newline scanning looks for either '\r' or '\n', so it gets
+ * its own SSE2 and AVX2 loops on x86-64, picked once at runtime.
+ */
+
+typedef const char *(buffer_scan)(const char *p, const char *end);
+
+static const char *scan_nl_scalar(const char *p, const char *end) {
+    for(; p < end; p++)
+        if(*p == '\r' || *p == '\n')
+            return p;
+    return NULL;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static const char *scan_nl_sse2(const char *p, const char *end) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    while(end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                                  _mm_cmpeq_epi8(v, lf)));
+        if(mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+
+    return scan_nl_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_nl_avx2(const char *p, const char *end) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    while(end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+                                                                 _mm256_cmpeq_epi8(v, lf)));
+        if(mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+
+    return scan_nl_sse2(p, end);
+}
+#endif
+
+static buffer_scan *scan_nl_impl = scan_nl_scalar;
+static pthread_once_t scan_nl_once = PTHREAD_ONCE_INIT;
+
+static void pick_scan_nl(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        scan_nl_impl = scan_nl_avx2;
+    else
+        scan_nl_impl = scan_nl_sse2;
+#endif
+}
+
+/*
+ * Find the first match past the read position, pulling more data as
+ * needed.  Bytes already searched are skipped after every pull, so a long
+ * line arriving in pieces is only scanned once.  Looks for c with memchr
+ * when there is no scanner.  Gives up after limit bytes, if limit isn't 0.
+ */
+static ssize_t buffer_find(PieBuffer *buffer, buffer_scan *scan, char c, size_t hint,
+                           size_t limit) {
+    PieBufferChunk *chunk;
+    size_t scanned = 0;
+    size_t pos, skip, n;
+    const char *p, *found;
+
     if(hint > 0)
         pull_data_until(buffer, hint);
 
-    base = buffer->offset;
     do {
-        for(i = base; i < buffer->data_size; i++) {
-            if(buffer->buffer[i] == c) {
-                return i - buffer->offset;
+        pos = 0;
+        for(chunk = buffer->head; chunk != NULL; chunk = chunk->next) {
+            n = chunk->end - chunk->start;
+            if(pos + n <= scanned) {
+                pos += n;
+                continue;
             }
+
+            skip = scanned > pos ? scanned - pos : 0;
+            p = chunk->data + chunk->start;
+            if(limit > 0 && pos + n > limit)
+                n = limit - pos;
+
+            if(scan != NULL)
+                found = (*scan)(p + skip, p + n);
+            else
+                found = memchr(p + skip, c, n - skip);
+            if(found != NULL)
+                return pos + (found - p);
+
+            pos += n;
+            if(limit > 0 && pos >= limit)
+                return -1;
         }
+        scanned = pos;
     } while(pull_data(buffer) >= 0);
     
     return -1;
 }
 
+ssize_t pie_buffer_findchar(PieBuffer *buffer, char c, size_t hint) {
+    return buffer_find(buffer, NULL, c, hint, 0);
+}
+
+ssize_t pie_buffer_findchar_within(PieBuffer *buffer, char c, size_t limit) {
+    return buffer_find(buffer, NULL, c, 0, limit);
+}
+
 ssize_t pie_buffer_findnl(PieBuffer *buffer, size_t hint) {
-    size_t base;
-    size_t i;
-    
-    if(hint > 0)
-        pull_data_until(buffer, hint);
+    pthread_once(&scan_nl_once, pick_scan_nl);
 
-    base = buffer->offset;
-    do {
-        for(i = base; i < buffer->data_size; i++) {
-            if(buffer->buffer[i] == '\r' || buffer->buffer[i] == '\n') {
-                return i - buffer->offset;
-            }
-        }
-    } while(pull_data(buffer) >= 0);
-    
-    return -1;
+    return buffer_find(buffer, scan_nl_impl, '\n', hint, 0);
 }
 
 char pie_buffer_peek(PieBuffer *buffer) {
@@ -330,8 +802,10 @@ char pie_buffer_peek(PieBuffer *buffer) {
     
     if(buffer->data_size == 0)
         return -1;
+
+    drop_consumed(buffer);
     
-    return *(buffer->buffer + buffer->offset);
+    return buffer->head->data[buffer->head->start];
 }
 
 ssize_t pie_buffer_getstr(PieBuffer *buffer, char *str, size_t len) {
@@ -342,6 +816,6 @@ ssize_t pie_buffer_getstr(PieBuffer *buffer, char *str, size_t len) {
     if(result <= 0)
         return result;
     
-    memcpy(str, p, len);
-    return len;
+    memcpy(str, p, result);
+    return result;
 }
@@ -24,17 +24,39 @@
 #define PIE_BUFFER_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 typedef struct PieBuffer PieBuffer;
+typedef struct PieBufferChunk PieBufferChunk;
+typedef struct PieBufferPool PieBufferPool;
 
 typedef int (buffer_pull_data)(PieBuffer*, void *);
-typedef int (buffer_push_data)(PieBuffer*, const char *, size_t, void *);
+typedef ssize_t (buffer_push_data)(PieBuffer*, struct iovec *, int, void *);
 
-struct PieBuffer {   
-    char *buffer;
-    size_t offset;
-    size_t data_size;
-    size_t buffer_size;
+struct PieBufferChunk {
+    PieBufferChunk *next;
+    size_t size;        /* capacity of data */
+    size_t start;       /* first unread byte */
+    size_t end;         /* one past last stored byte */
+    char data[];
+};
+
+#define PIE_POOL_CLASSES    (4)
+
+struct PieBufferPool {
+    PieBufferChunk *free[PIE_POOL_CLASSES];
+    size_t retained;        /* bytes sitting on free lists */
+    size_t max_retained;    /* never keep more than this */
+    size_t outstanding;     /* bytes handed out to buffers */
+    size_t peak;            /* most outstanding since last trim */
+    size_t watermark;       /* decaying average of recent peaks */
+};
+
+struct PieBuffer {
+    PieBufferPool *pool;
+    PieBufferChunk *head;
+    PieBufferChunk *tail;
+    size_t data_size;   /* unread bytes across all chunks */
     size_t max_size;
     
     buffer_pull_data *reader;
@@ -44,23 +66,36 @@ struct PieBuffer {
     void *writer_udata;
 };
 
+void pie_buffer_pool_init(PieBufferPool *pool, size_t max_retained);
+void pie_buffer_pool_trim(PieBufferPool *pool);
+void pie_buffer_pool_free(PieBufferPool *pool);
+
 int pie_buffer_init(PieBuffer *buffer);
 void pie_buffer_free_data(PieBuffer *buffer);
 void pie_buffer_restart(PieBuffer *buffer);
 void pie_buffer_set_reader(PieBuffer *buffer, buffer_pull_data *func, void *udata);
 void pie_buffer_set_maxsize(PieBuffer *buffer, size_t sz);
+void pie_buffer_set_pool(PieBuffer *buffer, PieBufferPool *pool);
 void pie_buffer_set_writer(PieBuffer *buffer, buffer_push_data *func, void *udata);
 ssize_t pie_buffer_recv(PieBuffer *buffer, int fd, size_t len);
 ssize_t pie_buffer_send(PieBuffer *buffer, int fd, size_t len);
 int pie_buffer_append(PieBuffer *buffer, const char *data, size_t len);
+char *pie_buffer_reserve(PieBuffer *buffer, size_t len, size_t *avail);
+void pie_buffer_commit(PieBuffer *buffer, size_t len);
 int pie_buffer_flush(PieBuffer *buffer);
+int pie_buffer_flush_with(PieBuffer *buffer, const char *data, size_t len);
 char pie_buffer_peek(PieBuffer *buffer);
 ssize_t pie_buffer_findchar(PieBuffer *buffer, char c, size_t hint);
+/* only looks at the first limit bytes, -1 if c isn't among them */
+ssize_t pie_buffer_findchar_within(PieBuffer *buffer, char c, size_t limit);
 ssize_t pie_buffer_findnl(PieBuffer *buffer, size_t hint);
 size_t pie_buffer_size(PieBuffer *buffer);
 int pie_buffer_getchar(PieBuffer *buffer);
 ssize_t pie_buffer_getstr(PieBuffer *buffer, char *str, size_t len);
 ssize_t pie_buffer_getptr(PieBuffer *buffer, char **p, size_t len);
+ssize_t pie_buffer_unget(PieBuffer *buffer, size_t len);
+int pie_buffer_get_iov(PieBuffer *buffer, struct iovec *iov, int iovcnt);
+void pie_buffer_consume(PieBuffer *buffer, size_t len);
 
 
 #endif
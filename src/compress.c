@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "compress.h"
+
+static const char *compressible_types[] = {
+    "application/json",
+    "application/javascript",
+    "application/x-javascript",
+    "application/xml",
+    "application/xhtml+xml",
+    "application/rss+xml",
+    "application/atom+xml",
+    "image/svg+xml",
+    NULL
+};
+
+/*
+ * Negotiation
+ */
+
+static int token_is(const char *tok, size_t len, const char *name) {
+    return strlen(name) == len && strncasecmp(tok, name, len) == 0;
+}
+
+/* q=0 turns a coding off, anything else is as good as any other */
+static int coding_refused(const char *params, const char *end) {
+    const char *q;
+
+    for(q = params; q + 1 < end; q++) {
+        if((q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+            q += 2;
+            while(q < end && *q == '0')
+                q++;
+            if(q < end && *q == '.')
+                q++;
+            while(q < end && *q == '0')
+                q++;
+            return q >= end || *q < '1' || *q > '9';
+        }
+    }
+    return 0;
+}
+
+int compress_negotiate(const ScgiHeaders *headers) {
+    const ScgiHeader *h;
+    const char *p, *end;
+    int gzip = 0, deflate = 0, star = 0;
+    int gzip_seen = 0, deflate_seen = 0;
+
+    h = scgi_find_header(headers, "HTTP_ACCEPT_ENCODING");
+    if(h == NULL)
+        return ENCODING_IDENTITY;
+
+    p = h->value;
+    end = h->value + h->value_len;
+    while(p < end) {
+        const char *tok, *tok_end, *item_end;
+        int ok;
+
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        tok = p;
+        while(p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        tok_end = p;
+        while(p < end && *p != ',')
+            p++;
+        item_end = p;
+
+        ok = !coding_refused(tok_end, item_end);
+        if(token_is(tok, tok_end - tok, "gzip") || token_is(tok, tok_end - tok, "x-gzip")) {
+            gzip = ok;
+            gzip_seen = 1;
+        } else if(token_is(tok, tok_end - tok, "deflate")) {
+            deflate = ok;
+            deflate_seen = 1;
+        } else if(token_is(tok, tok_end - tok, "*"))
+            star = ok;
+    }
+
+    if(gzip || (!gzip_seen && star))
+        return ENCODING_GZIP;
+    if(deflate || (!deflate_seen && star))
+        return ENCODING_DEFLATE;
+    return ENCODING_IDENTITY;
+}
+
+const char *compress_encoding_name(int encoding) {
+    switch(encoding) {
+    case ENCODING_GZIP:
+        return "gzip";
+    case ENCODING_DEFLATE:
+        return "deflate";
+    }
+    return "identity";
+}
+
+int compress_type_ok(const char *type, size_t len) {
+    const char *semi = memchr(type, ';', len);
+    size_t i;
+
+    if(semi != NULL)
+        len = semi - type;
+    while(len > 0 && (type[len-1] == ' ' || type[len-1] == '\t'))
+        len--;
+
+    if(len > 5 && strncasecmp(type, "text/", 5) == 0)
+        return 1;
+    if(len > 5 && (strncasecmp(type + len - 5, "+json", 5) == 0 ||
+                   strncasecmp(type + len - 4, "+xml", 4) == 0))
+        return 1;
+
+    for(i = 0; compressible_types[i] != NULL; i++) {
+        if(token_is(type, len, compressible_types[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Compressor
+ */
+
+void compressor_init(Compressor *c, int level) {
+    memset(&c->strm, 0, sizeof(c->strm));
+    c->encoding = ENCODING_IDENTITY;
+    c->level = level;
+}
+
+/* the stream is kept between responses, and only reset */
+int compressor_start(Compressor *c, int encoding) {
+    if(c->encoding == encoding)
+        return deflateReset(&c->strm) == Z_OK ? 0 : -1;
+
+    compressor_free(c);
+    if(deflateInit2(&c->strm, c->level, Z_DEFLATED,
+                    encoding == ENCODING_GZIP ? 15 + 16 : 15,
+                    8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    c->encoding = encoding;
+    return 0;
+}
+
+void compressor_free(Compressor *c) {
+    if(c->encoding != ENCODING_IDENTITY)
+        deflateEnd(&c->strm);
+    memset(&c->strm, 0, sizeof(c->strm));
+    c->encoding = ENCODING_IDENTITY;
+}
+
+int compressor_write(Compressor *c, PieBuffer *out, const char *data, size_t len,
+                     int flush, compress_tap *tap, void *udata) {
+    int rv;
+
+    c->strm.next_in = (Bytef *)data;
+    c->strm.avail_in = len;
+
+    for(;;) {
+        size_t avail;
+        size_t produced;
+        char *p;
+
+        p = pie_buffer_reserve(out, 0, &avail);
+        if(p == NULL) {
+            /* full, so make room */
+            if(pie_buffer_flush(out) < 0)
+                return -1;
+            p = pie_buffer_reserve(out, 0, &avail);
+            if(p == NULL)
+                return -1;
+        }
+
+        c->strm.next_out = (Bytef *)p;
+        c->strm.avail_out = avail;
+        rv = deflate(&c->strm, flush);
+        if(rv == Z_STREAM_ERROR)
+            return -1;
+
+        produced = avail - c->strm.avail_out;
+        if(produced > 0) {
+            if(tap != NULL)
+                tap(p, produced, udata);
+            pie_buffer_commit(out, produced);
+        }
+
+        if(flush == Z_FINISH) {
+            if(rv == Z_STREAM_END)
+                break;
+        } else if(c->strm.avail_in == 0 && c->strm.avail_out != 0)
+            break;
+    }
+
+    return 0;
+}
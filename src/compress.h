@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PIE_COMPRESS_H
+#define PIE_COMPRESS_H
+
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "buffer.h"
+#include "scgi.h"
+
+#define ENCODING_IDENTITY   (0)
+#define ENCODING_GZIP       (1)
+#define ENCODING_DEFLATE    (2)
+
+/* sees every compressed byte as it goes into the buffer */
+typedef void (compress_tap)(const char *data, size_t len, void *udata);
+
+typedef struct {
+    z_stream strm;
+    int encoding;           /* what strm was set up for, identity if not */
+    int level;
+} Compressor;
+
+/* best encoding the client takes from HTTP_ACCEPT_ENCODING */
+int compress_negotiate(const ScgiHeaders *headers);
+const char *compress_encoding_name(int encoding);
+
+/* whether a Content-Type is worth compressing */
+int compress_type_ok(const char *type, size_t len);
+
+void compressor_init(Compressor *c, int level);
+int compressor_start(Compressor *c, int encoding);
+void compressor_free(Compressor *c);
+
+/*
+ * Compress into out, flushing it through its writer whenever it fills up.
+ * flush is Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH.
+ */
+int compressor_write(Compressor *c, PieBuffer *out, const char *data, size_t len,
+                     int flush, compress_tap *tap, void *udata);
+
+#endif
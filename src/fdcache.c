@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+#endif
+
+#include "fdcache.h"
+
+#define MIN_BUCKETS     (64)
+
+/*
+ * Opening
+ *
+ * A symlink inside a static directory mustn't lead outside it.  openat2()
+ * lets the kernel enforce that while still allowing links that stay
+ * inside; without it every component is opened with O_NOFOLLOW, which
+ * refuses symlinks altogether.
+ */
+
+#ifdef O_PATH
+#define DIR_FLAGS   (O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#else
+#define DIR_FLAGS   (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#endif
+/* a FIFO would block the open until a writer came, so never wait */
+#define FILE_FLAGS  (O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK)
+
+static int open_nofollow(int dirfd, const char *path) {
+    char part[FD_CACHE_MAX_PATH];
+    const char *seg = path;
+    int fd = dirfd;
+
+    for(;;) {
+        const char *slash = strchr(seg, '/');
+        size_t seglen = slash ? (size_t)(slash - seg) : strlen(seg);
+        int next, saved;
+
+        if(seglen >= sizeof(part)) {
+            next = -1;
+            errno = ENAMETOOLONG;
+        } else {
+            memcpy(part, seg, seglen);
+            part[seglen] = '\0';
+            if(slash == NULL)
+                next = openat(fd, part, FILE_FLAGS | O_NOFOLLOW);
+            else if(seglen == 0)
+                next = dup(fd);
+            else
+                next = openat(fd, part, DIR_FLAGS);
+        }
+
+        saved = errno;
+        if(fd != dirfd)
+            close(fd);
+        errno = saved;
+
+        if(next < 0 || slash == NULL)
+            return next;
+        fd = next;
+        seg = slash + 1;
+    }
+}
+
+int fd_open_beneath(int dirfd, const char *path) {
+#ifdef SYS_openat2
+    static volatile int no_openat2 = 0;
+
+    if(!no_openat2) {
+        struct open_how how;
+        long fd;
+
+        memset(&how, 0, sizeof(how));
+        how.flags = FILE_FLAGS;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+        if(fd >= 0 || errno != ENOSYS)
+            return fd;
+        no_openat2 = 1;
+    }
+#endif
+    return open_nofollow(dirfd, path);
+}
+
+static long long now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long hash_key(dev_t dir_dev, ino_t dir_ino, const char *path) {
+    unsigned long h = 2166136261UL ^ (unsigned long)dir_ino ^ ((unsigned long)dir_dev << 16);
+
+    for(; *path; path++) {
+        h ^= (unsigned char)*path;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static int same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+           a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void entry_free(FdCacheEntry *e) {
+    close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+/*
+ * Table and LRU list, all with the lock held
+ */
+
+static FdCacheEntry *lookup(FdCache *cache, unsigned long hash, dev_t dir_dev, ino_t dir_ino,
+                            const char *path) {
+    FdCacheEntry *e;
+
+    if(cache->buckets == NULL)
+        return NULL;
+
+    for(e = cache->buckets[hash & (cache->nbuckets - 1)]; e != NULL; e = e->hnext) {
+        if(e->hash == hash && e->dir_ino == dir_ino && e->dir_dev == dir_dev &&
+           strcmp(e->path, path) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void lru_unlink(FdCache *cache, FdCacheEntry *e) {
+    if(e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+    if(e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(FdCache *cache, FdCacheEntry *e) {
+    e->prev = NULL;
+    e->next = cache->head;
+    if(cache->head)
+        cache->head->prev = e;
+    else
+        cache->tail = e;
+    cache->head = e;
+}
+
+static void insert(FdCache *cache, FdCacheEntry *e) {
+    FdCacheEntry **bucket = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+
+    e->hnext = *bucket;
+    *bucket = e;
+    lru_push(cache, e);
+    cache->count++;
+}
+
+/* take out of the table; the last reference frees it */
+static void detach(FdCache *cache, FdCacheEntry *e) {
+    FdCacheEntry **itr = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+
+    while(*itr != e)
+        itr = &(*itr)->hnext;
+    *itr = e->hnext;
+
+    lru_unlink(cache, e);
+    cache->count--;
+    e->stale = 1;
+}
+
+/* entries still in use are skipped, so the cache may briefly run over */
+static void evict(FdCache *cache) {
+    FdCacheEntry *e = cache->tail;
+
+    while(cache->count > cache->capacity && e != NULL) {
+        FdCacheEntry *prev = e->prev;
+        if(e->refs == 0) {
+            detach(cache, e);
+            entry_free(e);
+        }
+        e = prev;
+    }
+}
+
+/*
+ * Public
+ */
+
+int fd_cache_configure(FdCache *cache, int capacity, int ttl_ms) {
+    int rv = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    if(capacity < 0)
+        capacity = 0;
+    if(ttl_ms < 0)
+        ttl_ms = 0;
+
+    /* sized once; later capacity changes only lengthen the chains */
+    if(cache->buckets == NULL && capacity > 0) {
+        size_t n = MIN_BUCKETS;
+        while(n < (size_t)capacity)
+            n <<= 1;
+
+        cache->buckets = calloc(n, sizeof(FdCacheEntry *));
+        if(cache->buckets == NULL) {
+            errno = ENOMEM;
+            rv = -1;
+            capacity = 0;
+        } else
+            cache->nbuckets = n;
+    }
+
+    cache->capacity = capacity;
+    cache->ttl = (long long)ttl_ms * 1000;
+    if(cache->buckets != NULL)
+        evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    return rv;
+}
+
+int fd_cache_enabled(FdCache *cache) {
+    int enabled;
+
+    pthread_mutex_lock(&cache->lock);
+    enabled = cache->capacity > 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    return enabled;
+}
+
+FdCacheEntry *fd_cache_open(FdCache *cache, int dirfd, dev_t dir_dev, ino_t dir_ino,
+                            const char *path) {
+    unsigned long hash = hash_key(dir_dev, dir_ino, path);
+    long long now = now_usec();
+    FdCacheEntry *e, *found;
+    struct stat st;
+    int fd;
+
+    pthread_mutex_lock(&cache->lock);
+    e = lookup(cache, hash, dir_dev, dir_ino, path);
+    if(e != NULL) {
+        int fresh = now - e->checked < cache->ttl;
+
+        e->refs++;
+        lru_unlink(cache, e);
+        lru_push(cache, e);
+        pthread_mutex_unlock(&cache->lock);
+
+        if(fresh)
+            return e;
+
+        /* revalidate without holding the lock over the syscall */
+        if(fstatat(dirfd, path, &st, 0) == 0 && same_file(&st, &e->st)) {
+            pthread_mutex_lock(&cache->lock);
+            e->checked = now;
+            pthread_mutex_unlock(&cache->lock);
+            return e;
+        }
+
+        pthread_mutex_lock(&cache->lock);
+        if(!e->stale)
+            detach(cache, e);
+        pthread_mutex_unlock(&cache->lock);
+        fd_cache_release(cache, e);
+    } else
+        pthread_mutex_unlock(&cache->lock);
+
+    fd = fd_open_beneath(dirfd, path);
+    if(fd < 0)
+        return NULL;
+
+    e = malloc(sizeof(FdCacheEntry));
+    if(e == NULL || fstat(fd, &e->st) < 0) {
+        int saved = e == NULL ? ENOMEM : errno;
+        free(e);
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+
+    e->path = strdup(path);
+    if(e->path == NULL) {
+        free(e);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    e->hash = hash;
+    e->dir_dev = dir_dev;
+    e->dir_ino = dir_ino;
+    e->fd = fd;
+    e->checked = now;
+    e->refs = 1;
+    e->stale = 0;
+    e->hnext = e->prev = e->next = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if(cache->capacity == 0) {
+        /* turned off meanwhile, hand it out uncached */
+        e->stale = 1;
+    } else if((found = lookup(cache, hash, dir_dev, dir_ino, path)) != NULL &&
+              same_file(&found->st, &e->st)) {
+        /* another thread got there first */
+        found->refs++;
+        pthread_mutex_unlock(&cache->lock);
+        entry_free(e);
+        return found;
+    } else {
+        if(found != NULL)
+            detach(cache, found);
+        insert(cache, e);
+        if(found != NULL && found->refs == 0)
+            entry_free(found);
+        evict(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return e;
+}
+
+void fd_cache_release(FdCache *cache, FdCacheEntry *entry) {
+    int dead;
+
+    pthread_mutex_lock(&cache->lock);
+    entry->refs--;
+    dead = entry->stale && entry->refs == 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    if(dead)
+        entry_free(entry);
+}
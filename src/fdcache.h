@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PIE_FDCACHE_H
+#define PIE_FDCACHE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+typedef struct FdCacheEntry FdCacheEntry;
+
+struct FdCacheEntry {
+    FdCacheEntry *hnext;        /* hash chain */
+    FdCacheEntry *prev, *next;  /* lru list, most recent first */
+    unsigned long hash;
+
+    dev_t dir_dev;
+    ino_t dir_ino;
+    char *path;                 /* relative to the directory */
+
+    int fd;
+    struct stat st;             /* never changes once cached */
+    long long checked;          /* usec, last validated against the path */
+    int refs;
+    int stale;                  /* out of the table, closed on last release */
+};
+
+/*
+ * Open descriptors and their stat, keyed by directory and relative path,
+ * shared between threads.  Entries are trusted for ttl after being
+ * checked, then revalidated with a stat of the path, and reopened if the
+ * file was replaced or changed.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    FdCacheEntry **buckets;
+    size_t nbuckets;
+    FdCacheEntry *head, *tail;
+    int count;
+    int capacity;               /* 0 when disabled */
+    long long ttl;              /* usec */
+} FdCache;
+
+#define FD_CACHE_MAX_PATH   (4096)
+
+#define FD_CACHE_INIT   { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, NULL, 0, 0, 0 }
+
+int fd_cache_configure(FdCache *cache, int capacity, int ttl_ms);
+int fd_cache_enabled(FdCache *cache);
+
+/*
+ * Returns a referenced entry, or NULL with errno set.  The descriptor may be
+ * in use by other threads at the same time, so only use calls that take an
+ * explicit offset on it.
+ */
+FdCacheEntry *fd_cache_open(FdCache *cache, int dirfd, dev_t dir_dev, ino_t dir_ino,
+                            const char *path);
+void fd_cache_release(FdCache *cache, FdCacheEntry *entry);
+
+/*
+ * Open path read-only and non-blocking, without letting symlinks resolve
+ * outside dirfd.
+ * Returns the descriptor, or -1 with errno set.
+ */
+int fd_open_beneath(int dirfd, const char *path);
+
+#endif
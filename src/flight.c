@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flight.h"
+
+static void unlink_flight(FlightGroup *group, Flight *flight) {
+    Flight **itr;
+
+    for(itr = &group->flights; *itr != NULL; itr = &(*itr)->next) {
+        if(*itr == flight) {
+            *itr = flight->next;
+            break;
+        }
+    }
+    flight->next = NULL;
+}
+
+Flight *flight_join(FlightGroup *group, const char *key, size_t key_len, int *leader) {
+    Flight *f;
+
+    pthread_mutex_lock(&group->lock);
+    for(f = group->flights; f != NULL; f = f->next) {
+        if(f->key_len == key_len && memcmp(f->key, key, key_len) == 0) {
+            f->refs++;
+            pthread_mutex_unlock(&group->lock);
+            *leader = 0;
+            return f;
+        }
+    }
+
+    f = malloc(sizeof(Flight));
+    if(f == NULL || (f->key = malloc(key_len)) == NULL) {
+        pthread_mutex_unlock(&group->lock);
+        free(f);
+        return NULL;
+    }
+    memcpy(f->key, key, key_len);
+    f->key_len = key_len;
+    f->refs = 1;
+    f->landed = 0;
+    f->data = NULL;
+    f->data_len = 0;
+    pthread_cond_init(&f->cond, NULL);
+
+    f->next = group->flights;
+    group->flights = f;
+    pthread_mutex_unlock(&group->lock);
+
+    *leader = 1;
+    return f;
+}
+
+void flight_land(FlightGroup *group, Flight *flight, char *data, size_t data_len) {
+    pthread_mutex_lock(&group->lock);
+    /* later arrivals start a flight of their own */
+    unlink_flight(group, flight);
+    flight->data = data;
+    flight->data_len = data_len;
+    flight->landed = 1;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&group->lock);
+}
+
+int flight_wait(FlightGroup *group, Flight *flight, int timeout_ms) {
+    struct timespec deadline;
+    int shared;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&group->lock);
+    while(!flight->landed) {
+        if(pthread_cond_timedwait(&flight->cond, &group->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    shared = flight->landed && flight->data != NULL;
+    pthread_mutex_unlock(&group->lock);
+
+    return shared;
+}
+
+void flight_leave(FlightGroup *group, Flight *flight) {
+    int last;
+
+    pthread_mutex_lock(&group->lock);
+    last = --flight->refs == 0;
+    pthread_mutex_unlock(&group->lock);
+
+    if(last) {
+        pthread_cond_destroy(&flight->cond);
+        free(flight->data);
+        free(flight->key);
+        free(flight);
+    }
+}
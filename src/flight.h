@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PIE_FLIGHT_H
+#define PIE_FLIGHT_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef struct Flight Flight;
+
+struct Flight {
+    Flight *next;
+    char *key;
+    size_t key_len;
+
+    int refs;                   /* the leader and everyone waiting on it */
+    int landed;
+    char *data;                 /* the leader's response, NULL if not shared */
+    size_t data_len;
+    pthread_cond_t cond;
+};
+
+/*
+ * Requests in progress, so identical ones can wait for the first instead
+ * of repeating its work.  There are never more than there are threads, so
+ * a list does.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    Flight *flights;
+} FlightGroup;
+
+#define FLIGHT_GROUP_INIT   { PTHREAD_MUTEX_INITIALIZER, NULL }
+
+/* referenced flight for key, *leader set if the caller has to do the work */
+Flight *flight_join(FlightGroup *group, const char *key, size_t key_len, int *leader);
+
+/* leader only: publish the response (owned by the flight after) and wake waiters */
+void flight_land(FlightGroup *group, Flight *flight, char *data, size_t data_len);
+
+/*
+ * Block until landed or timeout_ms passes.  Returns 1 if there is a
+ * response to copy, 0 if the caller has to do the work itself.
+ */
+int flight_wait(FlightGroup *group, Flight *flight, int timeout_ms);
+
+void flight_leave(FlightGroup *group, Flight *flight);
+
+#endif
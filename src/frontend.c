@@ -0,0 +1,502 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifdef __linux__
+#define _GNU_SOURCE 1       /* accept4 */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "frontend.h"
+
+#define INITIAL_READ        (4096)
+#define MAX_EVENTS          (64)
+#define IDLE_TIMEOUT        (60000000LL)    /* usec */
+#define SWEEP_INTERVAL      (1000)          /* ms */
+
+static long long now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void frontend_conn_free(FrontendConn *conn) {
+    if(conn == NULL)
+        return;
+    free(conn->data);
+    free(conn);
+}
+
+/*
+ * Ready Queue
+ */
+
+FrontendConn *frontend_next(Frontend *fe, const int *quitting) {
+    FrontendConn *conn;
+    long long waited, max;
+
+    conn = work_queue_pop_wait(&fe->queue, quitting);
+    if(conn == NULL)
+        return NULL;
+
+    waited = now_usec() - conn->queued;
+    atomic_fetch_add_explicit(&fe->wait_total, waited, memory_order_relaxed);
+    max = atomic_load_explicit(&fe->wait_max, memory_order_relaxed);
+    while(waited > max && !atomic_compare_exchange_weak_explicit(&fe->wait_max, &max, waited,
+                                                                 memory_order_relaxed,
+                                                                 memory_order_relaxed))
+        ;
+
+#ifdef __linux__
+    /* there's room now, so let the loop move the overflow along */
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load(&fe->backlogged))
+        eventfd_write(fe->wake_fd, 1);
+#endif
+
+    return conn;
+}
+
+void frontend_wake(Frontend *fe) {
+    work_queue_wake_all(&fe->queue);
+}
+
+void frontend_get_stats(Frontend *fe, FrontendStats *stats) {
+    stats->queued = atomic_load_explicit(&fe->queue.pushed, memory_order_relaxed);
+    stats->taken = atomic_load_explicit(&fe->queue.popped, memory_order_relaxed);
+    stats->full = atomic_load_explicit(&fe->queue.full, memory_order_relaxed);
+    stats->depth = work_queue_depth(&fe->queue);
+    stats->max_depth = atomic_load_explicit(&fe->queue.max_depth, memory_order_relaxed);
+    stats->overflow = atomic_load_explicit(&fe->overflow_count, memory_order_relaxed);
+    stats->wait_total = atomic_load_explicit(&fe->wait_total, memory_order_relaxed);
+    stats->wait_max = atomic_load_explicit(&fe->wait_max, memory_order_relaxed);
+}
+
+/*
+ * Reading
+ */
+
+/* CONTENT_LENGTH from a complete header block, 0 if missing */
+static size_t block_content_length(const char *block, size_t size) {
+    const char *itr = block, *end = block + size;
+    const char *name, *value;
+
+    while(itr < end) {
+        name = itr;
+        itr = memchr(itr, '\0', end - itr);
+        if(itr == NULL)
+            break;
+        value = ++itr;
+        itr = memchr(itr, '\0', end - itr);
+        if(itr == NULL)
+            break;
+        itr++;
+
+        if(strcmp(name, "CONTENT_LENGTH") == 0) {
+            long long n = strtoll(value, NULL, 10);
+            return n > 0 ? (size_t)n : 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Work out how much to read before handing off.  Anything malformed is
+ * handed off as soon as that's clear, and left to the worker to answer.
+ * Returns 1 once enough has been read.
+ */
+static int conn_complete(Frontend *fe, FrontendConn *conn) {
+    size_t i, hsize = 0, block_end;
+
+    if(!conn->sized) {
+        for(i = 0; i < conn->len; i++) {
+            if(conn->data[i] == ':')
+                break;
+            if(conn->data[i] < '0' || conn->data[i] > '9' || i >= 10)
+                return 1;
+            hsize = hsize * 10 + (conn->data[i] - '0');
+        }
+        if(i == conn->len)
+            return conn->len >= fe->max_read;
+        if(i == 0)
+            return 1;
+
+        block_end = i + 1 + hsize + 1;
+        if(hsize > 0 && conn->len >= block_end - 1 && conn->data[block_end - 2] == ',') {
+            /* the comma was counted in the length, as scgi_read_headers allows */
+            block_end--;
+            hsize--;
+        }
+        conn->target = block_end;
+        if(conn->len >= block_end) {
+            size_t body = block_content_length(conn->data + i + 1, hsize);
+
+            if(body > fe->body_size)
+                body = fe->body_size;
+            conn->target = block_end + body;
+            conn->sized = 1;
+        }
+        if(conn->target > fe->max_read) {
+            conn->target = fe->max_read;
+            conn->sized = 1;
+        }
+    }
+
+    return conn->len >= conn->target && (conn->sized || conn->len >= fe->max_read);
+}
+
+static void reading_unlink(Frontend *fe, FrontendConn *conn) {
+    if(conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        fe->reading = conn->next;
+    if(conn->next != NULL)
+        conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+static void conn_drop(Frontend *fe, FrontendConn *conn) {
+    reading_unlink(fe, conn);
+    close(conn->fd);
+    frontend_conn_free(conn);
+}
+
+#ifdef __linux__
+
+static void set_accepting(Frontend *fe, int accepting) {
+    struct epoll_event ev;
+
+    if(fe->accepting == accepting)
+        return;
+
+    if(!accepting) {
+        if(epoll_ctl(fe->epoll_fd, EPOLL_CTL_DEL, fe->listen_fd, NULL) == 0)
+            fe->accepting = 0;
+        return;
+    }
+
+    ev.data.ptr = &fe->listen_fd;
+#ifdef EPOLLEXCLUSIVE
+    /* other processes may be waiting on the same socket, only wake one */
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    if(epoll_ctl(fe->epoll_fd, EPOLL_CTL_ADD, fe->listen_fd, &ev) == 0) {
+        fe->accepting = 1;
+        return;
+    }
+#endif
+    ev.events = EPOLLIN;
+    if(epoll_ctl(fe->epoll_fd, EPOLL_CTL_ADD, fe->listen_fd, &ev) == 0)
+        fe->accepting = 1;
+}
+
+/* move what the workers made room for from the overflow to the queue */
+static void drain_overflow(Frontend *fe) {
+    FrontendConn *conn, *next;
+
+    while((conn = fe->overflow_head) != NULL) {
+        /* once pushed, a worker may take and free it at any moment */
+        next = conn->next;
+        if(work_queue_push(&fe->queue, conn) < 0)
+            return;
+        fe->overflow_head = next;
+        if(fe->overflow_head == NULL)
+            fe->overflow_tail = NULL;
+        atomic_fetch_sub_explicit(&fe->overflow_count, 1, memory_order_relaxed);
+    }
+
+    atomic_store(&fe->backlogged, 0);
+    set_accepting(fe, 1);
+}
+
+static void conn_dispatch(Frontend *fe, FrontendConn *conn) {
+    int flags;
+
+    reading_unlink(fe, conn);
+    epoll_ctl(fe->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+
+    /* workers do plain blocking reads and writes */
+    flags = fcntl(conn->fd, F_GETFL);
+    if(flags >= 0)
+        fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    conn->queued = now_usec();
+    if(fe->overflow_head == NULL && work_queue_push(&fe->queue, conn) == 0)
+        return;
+
+    if(fe->overflow_tail != NULL)
+        fe->overflow_tail->next = conn;
+    else
+        fe->overflow_head = conn;
+    fe->overflow_tail = conn;
+    atomic_fetch_add_explicit(&fe->overflow_count, 1, memory_order_relaxed);
+
+    /* workers poke us once they see this, and make room */
+    atomic_store(&fe->backlogged, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    set_accepting(fe, 0);
+    drain_overflow(fe);
+}
+
+/* returns 1 if the connection was handed off or dropped */
+static int conn_read(Frontend *fe, FrontendConn *conn) {
+    ssize_t got;
+
+    for(;;) {
+        size_t want = conn->target > conn->len ? conn->target : conn->len + INITIAL_READ;
+
+        if(want > fe->max_read)
+            want = fe->max_read;
+        if(want > conn->size) {
+            char *data = realloc(conn->data, want);
+            if(data == NULL) {
+                conn_drop(fe, conn);
+                return 1;
+            }
+            conn->data = data;
+            conn->size = want;
+        }
+
+        got = read(conn->fd, conn->data + conn->len, want - conn->len);
+        if(got < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            conn_drop(fe, conn);
+            return 1;
+        } else if(got == 0) {
+            /* the client is done sending, let the worker make what it can of it */
+            if(conn->len > 0)
+                conn_dispatch(fe, conn);
+            else
+                conn_drop(fe, conn);
+            return 1;
+        }
+
+        conn->len += got;
+        conn->active = now_usec();
+        if(conn_complete(fe, conn)) {
+            conn_dispatch(fe, conn);
+            return 1;
+        }
+    }
+}
+
+static void accept_conns(Frontend *fe) {
+    struct epoll_event ev;
+    FrontendConn *conn;
+    int fd;
+
+    while(fe->accepting) {
+        fd = accept4(fe->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+
+        conn = calloc(1, sizeof(FrontendConn));
+        if(conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->active = now_usec();
+
+        conn->next = fe->reading;
+        if(fe->reading != NULL)
+            fe->reading->prev = conn;
+        fe->reading = conn;
+
+        /* the request has usually arrived with the connection */
+        if(conn_read(fe, conn))
+            continue;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if(epoll_ctl(fe->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            conn_drop(fe, conn);
+    }
+}
+
+static void sweep_idle(Frontend *fe) {
+    FrontendConn *conn, *next;
+    long long cutoff = now_usec() - IDLE_TIMEOUT;
+
+    for(conn = fe->reading; conn != NULL; conn = next) {
+        next = conn->next;
+        if(conn->active < cutoff)
+            conn_drop(fe, conn);
+    }
+}
+
+int frontend_init(Frontend *fe, int listen_fd, size_t max_read, size_t body_size,
+                  size_t queue_size) {
+    struct epoll_event ev;
+    int flags;
+
+    memset(fe, 0, sizeof(Frontend));
+    fe->listen_fd = listen_fd;
+    fe->max_read = max_read;
+    fe->body_size = body_size;
+    fe->epoll_fd = fe->wake_fd = -1;
+    atomic_init(&fe->backlogged, 0);
+    atomic_init(&fe->overflow_count, 0);
+    atomic_init(&fe->wait_total, 0);
+    atomic_init(&fe->wait_max, 0);
+
+    if(work_queue_init(&fe->queue, queue_size) < 0)
+        return -1;
+
+    fe->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(fe->epoll_fd < 0)
+        return -1;
+    fe->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fe->wake_fd < 0)
+        return -1;
+
+    flags = fcntl(listen_fd, F_GETFL);
+    if(flags < 0 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+
+    set_accepting(fe, 1);
+    if(!fe->accepting)
+        return -1;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &fe->wake_fd;
+    if(epoll_ctl(fe->epoll_fd, EPOLL_CTL_ADD, fe->wake_fd, &ev) < 0)
+        return -1;
+
+    return 0;
+}
+
+int frontend_run(Frontend *fe) {
+    struct epoll_event events[MAX_EVENTS];
+    long long last_sweep = now_usec();
+    int i, n;
+
+    while(!fe->quitting) {
+        n = epoll_wait(fe->epoll_fd, events, MAX_EVENTS, SWEEP_INTERVAL);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for(i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if(ptr == &fe->listen_fd) {
+                if(fe->accepting)
+                    accept_conns(fe);
+            } else if(ptr == &fe->wake_fd) {
+                eventfd_t v;
+                eventfd_read(fe->wake_fd, &v);
+            } else {
+                conn_read(fe, (FrontendConn *)ptr);
+            }
+        }
+
+        if(fe->overflow_head != NULL)
+            drain_overflow(fe);
+
+        if(now_usec() - last_sweep >= SWEEP_INTERVAL * 1000LL) {
+            sweep_idle(fe);
+            last_sweep = now_usec();
+        }
+    }
+
+    return 0;
+}
+
+void frontend_halt(Frontend *fe) {
+    fe->quitting = 1;
+    if(fe->wake_fd >= 0)
+        eventfd_write(fe->wake_fd, 1);
+}
+
+#else
+
+int frontend_init(Frontend *fe, int listen_fd, size_t max_read, size_t body_size,
+                  size_t queue_size) {
+    memset(fe, 0, sizeof(Frontend));
+    fe->listen_fd = listen_fd;
+    fe->epoll_fd = fe->wake_fd = -1;
+
+    errno = ENOSYS;
+    return -1;
+}
+
+int frontend_run(Frontend *fe) {
+    errno = ENOSYS;
+    return -1;
+}
+
+void frontend_halt(Frontend *fe) {
+    fe->quitting = 1;
+}
+
+#endif
+
+void frontend_free(Frontend *fe) {
+    FrontendConn *conn;
+
+    while(fe->reading != NULL)
+        conn_drop(fe, fe->reading);
+
+    /* nobody is left to answer these */
+    while((conn = fe->overflow_head) != NULL) {
+        fe->overflow_head = conn->next;
+        close(conn->fd);
+        frontend_conn_free(conn);
+    }
+    fe->overflow_tail = NULL;
+    atomic_store_explicit(&fe->overflow_count, 0, memory_order_relaxed);
+
+    if(fe->queue.cells != NULL) {
+        while((conn = work_queue_pop(&fe->queue)) != NULL) {
+            close(conn->fd);
+            frontend_conn_free(conn);
+        }
+        work_queue_free(&fe->queue);
+    }
+
+    if(fe->epoll_fd >= 0)
+        close(fe->epoll_fd);
+    if(fe->wake_fd >= 0)
+        close(fe->wake_fd);
+    fe->epoll_fd = fe->wake_fd = -1;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PIE_FRONTEND_H
+#define PIE_FRONTEND_H
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "workqueue.h"
+
+typedef struct FrontendConn FrontendConn;
+
+struct FrontendConn {
+    FrontendConn *prev, *next;  /* reading list, or next in the overflow */
+    int fd;
+    char *data;                 /* everything read so far */
+    size_t len;
+    size_t size;
+    size_t target;              /* bytes to read before handing off, 0 until known */
+    int sized;                  /* target includes the body */
+    long long active;           /* usec, last time anything arrived */
+    long long queued;           /* usec, when handed off */
+};
+
+/*
+ * Accepts connections and reads them non-blocking from a single epoll
+ * thread until the SCGI header block, and the body up to body_size, are
+ * in memory.  Only then is the connection queued for a worker, so slow
+ * clients never hold one up.
+ *
+ * When the workers fall behind and the queue fills up, connections wait
+ * in an overflow list and accepting stops, leaving the rest in the
+ * kernel's backlog, until a worker takes one and pokes the loop.
+ */
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;
+    size_t max_read;            /* most read ahead per connection */
+    size_t body_size;
+    volatile int quitting;
+
+    FrontendConn *reading;      /* connections still being read */
+    FrontendConn *overflow_head, *overflow_tail;
+    atomic_int overflow_count;  /* read by stats from other threads */
+    int accepting;              /* listen_fd is in the epoll set */
+
+    WorkQueue queue;
+    atomic_int backlogged;      /* set while there is overflow */
+    atomic_ullong wait_total;   /* usec connections spent queued */
+    atomic_llong wait_max;
+} Frontend;
+
+typedef struct {
+    unsigned long long queued;
+    unsigned long long taken;
+    unsigned long long full;
+    size_t depth;
+    size_t max_depth;
+    int overflow;
+    unsigned long long wait_total;  /* usec */
+    long long wait_max;             /* usec */
+} FrontendStats;
+
+int frontend_init(Frontend *fe, int listen_fd, size_t max_read, size_t body_size,
+                  size_t queue_size);
+void frontend_free(Frontend *fe);
+
+/* runs until frontend_halt(), -1 with errno set on failure */
+int frontend_run(Frontend *fe);
+void frontend_halt(Frontend *fe);
+
+/* blocks for the next ready connection, NULL once *quitting is set */
+FrontendConn *frontend_next(Frontend *fe, const int *quitting);
+
+/* wake threads blocked in frontend_next() so they see *quitting */
+void frontend_wake(Frontend *fe);
+
+void frontend_get_stats(Frontend *fe, FrontendStats *stats);
+
+/* frees the read data, the descriptor is left to the caller */
+void frontend_conn_free(FrontendConn *conn);
+
+#endif
@@ -20,33 +20,109 @@
  * THE SOFTWARE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE 1       /* splice, pipe2 */
+#endif
+
 #include <signal.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
 
 #ifdef __linux__
 #include <sys/sendfile.h>
+#include <malloc.h>
 #endif
 
 #include <Python.h>
 
 #include "buffer.h"
+#include "compress.h"
+#include "fdcache.h"
+#include "flight.h"
+#include "frontend.h"
+#include "respcache.h"
+#include "scgi.h"
+#include "static.h"
+#include "workerpool.h"
+
+#define DEFAULT_POOL_SIZE   (262144)
+#define MIN_READ_SIZE       (4096)
+#define MAX_READ_SIZE       (65536)
+#define DIRECT_WRITE_SIZE   (16384)
+#define SENDFILE_SIZE       (1 << 30)
+#define SPLICE_SIZE         (65536)
+#define DEFAULT_FD_CACHE_SIZE   (512)
+#define DEFAULT_FD_CACHE_TTL    (2000)
+#define MAX_SHARED_SIZE         (4194304)
+#define DEFAULT_COMPRESS_MIN    (1024)
+#define DEFAULT_FRONTEND_BODY   (16384)
+#define DEFAULT_FRONTEND_QUEUE  (1024)
+#define DEFAULT_IDLE_TIMEOUT    (30000)
+#define COALESCE_TIMEOUT        (10000)
+#define ENVIRON_KEYS_SIZE       (128)
 
 static int filewrapper_TypeCheck(PyObject *self);
 static int input_TypeCheck(PyObject *self);
 static int request_TypeCheck(PyObject *self);
+static int frontend_TypeCheck(PyObject *self);
+static int worker_pool_TypeCheck(PyObject *self);
 
 static PyObject *request_accept_loop(PyObject *self, PyObject *args);
 static PyObject *request_halt_loop(PyObject *self, PyObject *args);
 static PyObject *request_run_once(PyObject *self, PyObject *args);
 static int req_buffer_do_read(PieBuffer *buffer, void *udata);
-static int resp_buffer_do_write(PieBuffer *buffer, const char *buf, size_t count, void *udata);
+static ssize_t resp_buffer_do_write(PieBuffer *buffer, struct iovec *iov, int iovcnt, void *udata);
 
 /*
  * Object Definitions
  */
 
+/*
+ * Everything Python the module makes lives in its state rather than in
+ * statics, so each interpreter that imports it gets its own.  Types are
+ * created per interpreter, so instances are recognised by their
+ * deallocator instead.
+ */
+typedef struct {
+    PyTypeObject *request_type;
+    PyTypeObject *input_type;
+    PyTypeObject *filewrapper_type;
+    PyTypeObject *environ_type;
+    PyTypeObject *frontend_type;
+    PyTypeObject *worker_pool_type;
+#if PY_VERSION_HEX >= 0x030C0000
+    PyTypeObject *subinterpreter_type;
+#endif
+
+    PyObject *str_wsgi_input;
+    PyObject *str_wsgi_run_once;
+    PyObject *str_wsgi_url_scheme;
+    PyObject *str_http;
+    PyObject *str_https;
+    PyObject *environ_keys[ENVIRON_KEYS_SIZE];
+} PieState;
+
+#if PY_VERSION_HEX < 0x03090000
+static PieState *legacy_state;  /* no module state from types before 3.9 */
+#endif
+
+static PyObject *environ_template_new(PieState *st, int multithread, int multiprocess);
+
+static PieState *pie_state_from_type(PyTypeObject *type) {
+#if PY_VERSION_HEX >= 0x03090000
+    return (PieState *)PyType_GetModuleState(type);
+#else
+    return legacy_state;
+#endif
+}
+
 typedef struct {
     PyObject_HEAD
 
@@ -59,42 +135,107 @@ typedef struct {
 
     PyObject *object;
     int chunk_size;
+    long long offset;       /* -1 for wherever the file is */
+    long long length;       /* -1 for up to EOF */
+    long long remaining;    /* left to hand out when iterating */
+    int seeked;
 } FileWrapperObject;
 
 typedef struct {
     PyObject_HEAD
 
+    Frontend fe;
+    int ready;          /* fe was initialized */
+    int running;
+} FrontendObject;
+
+typedef struct {
+    PyObject_HEAD
+
+    WorkerPool pool;
+    int ready;          /* pool was initialized */
+} WorkerPoolObject;
+
+typedef struct {
+    PyObject_HEAD
+
+    PieState *state;
+
     int write_fd;
     int read_fd;
 
+    PieBufferPool pool;     /* chunks shared by req and resp buffers */
+
     struct loop_state {
         int quitting;
+        volatile int *halted;   /* also stop once set, from outside the interpreter */
         int in_accept;
         long thread_id;
 
         PyObject *application;
+        PyObject *environ_template;
+        int lazy_environ;
+        int coalesce;
+        int compress_level;     /* 0 when off */
+        int compress_min_size;
         int allow_buffering;
+        int cork_size;          /* 0 to write every chunk as it comes */
+        int cork_delay;         /* ms */
+        int tcp_cork;           /* -1 until tried on an accepted socket */
+        StaticFiles static_files;
+        RespCacheVary cache_vary;
         int listen_fd;
+        FrontendObject *frontend;   /* hands over read requests instead of accept */
+        WorkerPoolObject *worker_pool;  /* told when busy, and may retire this thread */
     } loop_state;
 
     struct {
         PieBuffer buffer;
+        ScgiHeaders headers;
 
         PyObject *environ;
         InputObject *input;
         int input_size;       /* remaining from scgi */
         int reading_input;
+        size_t read_size;     /* grows while reads keep coming back full */
+        char *cache_key;
+        ssize_t cache_key_len;  /* -1 if not cacheable */
+        Flight *flight;         /* others are waiting on this response */
+        int encoding;           /* best the client accepts */
     } req;
 
     struct {
         PieBuffer buffer;
 
         int headers_sent;
+        int compressing;
+        int no_compress;        /* body doesn't go through send_body */
+        int broken;             /* compressing failed, nothing more goes out */
+        int vary_encoding;      /* say it depends on Accept-Encoding */
+        Compressor compressor;
+        int corked;             /* TCP_CORK is set on write_fd */
+        long long cork_since;   /* usec, when the held back body started */
+        long long last_chunk;   /* usec */
+        int capturing;          /* copying the response for the cache or waiters */
+        int cacheable;
+        int shareable;
+        int capture_ttl;
+        char *capture;
+        size_t capture_len;
+        size_t capture_size;
+        size_t capture_max;
         PyObject *status;
         PyObject *headers;
     } resp;
 } RequestObject;
 
+static void request_print_info(RequestObject *req);
+
+/* open static files and cached responses, shared by all threads */
+static FdCache fd_cache = FD_CACHE_INIT;
+static RespCache resp_cache = RESP_CACHE_INIT;
+static FlightGroup flights = FLIGHT_GROUP_INIT;
+
 /*
  * Utility
  */
@@ -144,7 +285,7 @@ static PieBuffer *input_get_buffer(PyObject *self) {
 
 static PyObject *input_read(PyObject *self, PyObject *args) {
     int size = -1;
-    size_t justread;
+    ssize_t justread;
     PieBuffer *buf;
     char *p;
    
@@ -159,7 +300,9 @@ static PyObject *input_read(PyObject *self, PyObject *args) {
         size = ((InputObject*)self)->size;
 
     justread = pie_buffer_getptr(buf, &p, size);
-    if(justread <= 0)
+    if(justread < 0)
+        return PyErr_NoMemory();
+    if(justread == 0)
         return PyBytes_FromString("");
     else
         return PyBytes_FromStringAndSize(p, justread);
@@ -168,7 +311,7 @@ static PyObject *input_read(PyObject *self, PyObject *args) {
 static PyObject *input_readline(PyObject *self, PyObject *args) {
     int hint_size = -1;
     ssize_t loc;
-    size_t justread;
+    ssize_t justread;
     char *p;
     PieBuffer *buf;
 
@@ -189,7 +332,9 @@ static PyObject *input_readline(PyObject *self, PyObject *args) {
     }
 
     justread = pie_buffer_getptr(buf, &p, loc + 1);
-    if(justread <= 0)
+    if(justread < 0)
+        return PyErr_NoMemory();
+    if(justread == 0)
         return PyBytes_FromString("");
     else {
         ((InputObject*)self)->size -= justread;
@@ -287,60 +432,46 @@ static PyGetSetDef InputGetSet[] = {
     {NULL}
 };
 
-static PyTypeObject InputType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "scgi_pie.Input",          /*tp_name*/
-    sizeof(InputObject),       /*tp_basicsize*/
-    0,                         /*tp_itemsize*/
-    0,                         /*tp_dealloc*/
-    0,                         /*tp_print*/
-    0,                         /*tp_getattr*/
-    0,                         /*tp_setattr*/
-    0,                         /*tp_compare*/
-    0,                         /*tp_repr*/
-    0,                         /*tp_as_number*/
-    0,                         /*tp_as_sequence*/
-    0,                         /*tp_as_mapping*/
-    0,                         /*tp_hash */
-    0,                         /*tp_call*/
-    0,                         /*tp_str*/
-    0,                         /*tp_getattro*/
-    0,                         /*tp_setattro*/
-    0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
-    "wsgi.input",              /*tp_doc */
-    0,                         /*tp_traverse */
-    0,                         /*tp_clear */
-    0,                         /*tp_richcompare */
-    0,                         /*tp_weaklistoffset */
-    (getiterfunc)input_iter,   /*tp_iter */
-    (iternextfunc)input_iternext, /*tp_iternext */
-    InputMethods,              /*tp_methods */
-    0,                         /*tp_members*/
-    InputGetSet,               /*tp_getset*/
-    0,                         /*tp_base*/
-    0,                         /*tp_dict*/
-    0,                         /*tp_descr_get*/
-    0,                         /*tp_descr_set*/
-    0,                         /*tp_dictoffset*/
-    0,                         /*tp_init*/
-    0,                         /*tp_alloc*/
-    PyType_GenericNew,         /*tp_new*/
-    0,                         /*tp_free*/
-    0,                         /*tp_is_gc*/
+static void input_dealloc(PyObject *self) {
+    PyTypeObject *type = Py_TYPE(self);
+
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyType_Slot InputSlots[] = {
+    {Py_tp_dealloc, (void *)input_dealloc},
+    {Py_tp_doc, "wsgi.input"},
+    {Py_tp_iter, (void *)input_iter},
+    {Py_tp_iternext, (void *)input_iternext},
+    {Py_tp_methods, InputMethods},
+    {Py_tp_getset, InputGetSet},
+    {Py_tp_new, (void *)PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec InputSpec = {
+    "scgi_pie.Input",          /*name*/
+    sizeof(InputObject),       /*basicsize*/
+    0,                         /*itemsize*/
+    Py_TPFLAGS_DEFAULT,        /*flags*/
+    InputSlots,                /*slots*/
 };
 
 static int input_TypeCheck(PyObject *self) {
-    return PyObject_TypeCheck(self, &InputType);
+    return Py_TYPE(self)->tp_dealloc == input_dealloc;
 }
 
 /*
  * File Wrapper
  */
 
-static void filewrapper_dealloc(FileWrapperObject* self) {
-    Py_DECREF(self->object);
-    Py_TYPE(self)->tp_free((PyObject*)self);
+static void filewrapper_dealloc(PyObject *self) {
+    PyTypeObject *type = Py_TYPE(self);
+
+    Py_DECREF(((FileWrapperObject*)self)->object);
+    type->tp_free(self);
+    Py_DECREF(type);
 }
 
 static PyObject *filewrapper_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
@@ -351,6 +482,10 @@ static PyObject *filewrapper_new(PyTypeObject *type, PyObject *args, PyObject *k
         Py_INCREF(Py_None);
         self->object = Py_None;
         self->chunk_size = 8192;
+        self->offset = -1;
+        self->length = -1;
+        self->remaining = -1;
+        self->seeked = 0;
     }
 
     return (PyObject *)self;
@@ -359,13 +494,21 @@ static PyObject *filewrapper_new(PyTypeObject *type, PyObject *args, PyObject *k
 static int filewrapper_init(FileWrapperObject *self, PyObject *args, PyObject *kwargs) {
     PyObject *fileobj = NULL;
     int chunk_size = -1;
-    static char *kwlist[] = {"fileobj", "chunk_size", NULL};
+    long long offset = -1;
+    long long length = -1;
+    static char *kwlist[] = {"fileobj", "chunk_size", "offset", "length", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist,
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iLL", kwlist,
                                       &fileobj,
-                                      &chunk_size))
+                                      &chunk_size,
+                                      &offset,
+                                      &length))
         return -1;
 
+    self->offset = offset < 0 ? -1 : offset;
+    self->length = self->remaining = length < 0 ? -1 : length;
+    self->seeked = 0;
+
     Py_INCREF(fileobj);
     Py_DECREF(self->object);
     self->object = fileobj;
@@ -419,6 +562,54 @@ static PyObject *filewrapper_iter(PyObject *self) {
     return (PyObject*)self;
 }
 
+/*
+ * Move to the requested offset.  Pipes and sockets can't seek, so for
+ * those the leading bytes are read and thrown away instead.
+ */
+static int filewrapper_skip(FileWrapperObject *fw) {
+    PyObject *rv;
+    long long left;
+    int seekable = 1;
+
+    rv = PyObject_CallMethod(fw->object, "seekable", NULL);
+    if(rv != NULL) {
+        seekable = PyObject_IsTrue(rv);
+        Py_DECREF(rv);
+        if(seekable < 0)
+            return -1;
+    } else if(PyErr_ExceptionMatches(PyExc_AttributeError)) {
+        PyErr_Clear();
+    } else {
+        return -1;
+    }
+
+    if(seekable) {
+        rv = PyObject_CallMethod(fw->object, "seek", "L", fw->offset);
+        if(rv == NULL)
+            return -1;
+        Py_DECREF(rv);
+        return 0;
+    }
+
+    for(left = fw->offset; left > 0; ) {
+        Py_ssize_t len;
+
+        rv = PyObject_CallMethod(fw->object, "read", "L",
+                                 left < fw->chunk_size ? left : (long long)fw->chunk_size);
+        if(rv == NULL)
+            return -1;
+        len = PyObject_Length(rv);
+        Py_DECREF(rv);
+        if(len < 0)
+            return -1;
+        if(len == 0)
+            break;
+        left -= len;
+    }
+
+    return 0;
+}
+
 static PyObject *filewrapper_iternext(PyObject *self) {
     PyObject *read_method;
     PyObject *args, *rv;
@@ -430,16 +621,34 @@ static PyObject *filewrapper_iternext(PyObject *self) {
     }
 
     fw = (FileWrapperObject *)self;
+    if(fw->remaining == 0) {
+        PyErr_SetNone(PyExc_StopIteration);
+        return NULL;
+    }
+
+    if(fw->offset >= 0 && !fw->seeked) {
+        if(filewrapper_skip(fw) < 0)
+            return NULL;
+        fw->seeked = 1;
+    }
+
     read_method = PyObject_GetAttrString(fw->object, "read");
     if(read_method == NULL)
         return NULL;
 
-    args = Py_BuildValue("(i)", fw->chunk_size);
+    if(fw->remaining > 0 && fw->remaining < fw->chunk_size)
+        args = Py_BuildValue("(L)", fw->remaining);
+    else
+        args = Py_BuildValue("(i)", fw->chunk_size);
     rv = PyObject_CallObject(read_method, args);
     Py_DECREF(args);
+    Py_DECREF(read_method);
 
     if(rv != NULL) {
-        if(PyObject_Length(rv) == 0) {
+        Py_ssize_t len = PyObject_Length(rv);
+        if(len > 0 && fw->remaining > 0)
+            fw->remaining -= len < fw->remaining ? len : fw->remaining;
+        if(len == 0) {
             Py_DECREF(rv);
             PyErr_SetNone(PyExc_StopIteration);
             rv = NULL;
@@ -450,37 +659,178 @@ static PyObject *filewrapper_iternext(PyObject *self) {
 }
 
 #ifdef __linux__
-int filewrapper_accel_linux_sendfile(int infd, int outfd) {    
-    off_t offset;
-    off_t remaining;
+/* block until a non-blocking fd is ready again */
+static int wait_fd(int fd, short events) {
+    struct pollfd pfd;
+    int rv;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    do {
+        rv = poll(&pfd, 1, -1);
+    } while(rv < 0 && errno == EINTR);
+
+    return rv < 0 ? -1 : 0;
+}
+
+/*
+ * Send count bytes of a regular file starting at offset.  sendfile()
+ * advances offset itself, and leaves the file position alone.  Stops early
+ * if the file shrinks underneath us.
+ */
+static int filewrapper_linux_sendfile(int infd, int outfd, off_t offset, off_t count,
+                                      off_t *sent) {
+    while(count > 0) {
+        size_t want = count > SENDFILE_SIZE ? SENDFILE_SIZE : (size_t)count;
+        ssize_t gotbytes = sendfile(outfd, infd, &offset, want);
+
+        if(gotbytes < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN) {
+                if(wait_fd(outfd, POLLOUT) < 0)
+                    return -1;
+                continue;
+            }
+            return -1;
+        }
+        if(gotbytes == 0)
+            break;
+
+        *sent += gotbytes;
+        count -= gotbytes;
+    }
+
+    return 0;
+}
+
+/*
+ * Move up to count bytes (or everything until EOF, if count is negative)
+ * from any spliceable source.  Pipes are spliced straight to the output,
+ * anything else goes through a pipe of our own.
+ */
+static int filewrapper_linux_splice(int infd, int outfd, off_t count, off_t *sent) {
     struct stat statinfo;
+    int pipefd[2] = { -1, -1 };
+    int direct;
+    int rv = -1;
 
-    offset = lseek(infd, 0, SEEK_CUR);
-    if(offset < 0)
+    direct = fstat(infd, &statinfo) == 0 && S_ISFIFO(statinfo.st_mode);
+    if(!direct && pipe2(pipefd, O_CLOEXEC) < 0)
         return -1;
 
+    while(count != 0) {
+        size_t want = count < 0 || count > SPLICE_SIZE ? SPLICE_SIZE : (size_t)count;
+        ssize_t gotbytes;
+
+        if(direct) {
+            gotbytes = splice(infd, NULL, outfd, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(gotbytes < 0) {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN) {
+                    if(wait_fd(infd, POLLIN) < 0 || wait_fd(outfd, POLLOUT) < 0)
+                        goto done;
+                    continue;
+                }
+                goto done;
+            }
+            *sent += gotbytes;
+        } else {
+            ssize_t left;
+
+            gotbytes = splice(infd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(gotbytes < 0) {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN) {
+                    /* our pipe is empty here, so it's the source that isn't ready */
+                    if(wait_fd(infd, POLLIN) < 0)
+                        goto done;
+                    continue;
+                }
+                goto done;
+            }
+
+            for(left = gotbytes; left > 0; ) {
+                ssize_t moved = splice(pipefd[0], NULL, outfd, NULL, left,
+                                       SPLICE_F_MOVE | SPLICE_F_MORE);
+                if(moved < 0) {
+                    if(errno == EINTR)
+                        continue;
+                    if(errno == EAGAIN) {
+                        if(wait_fd(outfd, POLLOUT) < 0)
+                            goto done;
+                        continue;
+                    }
+                    goto done;
+                }
+                left -= moved;
+                *sent += moved;
+            }
+        }
+
+        if(gotbytes == 0)
+            break;
+        if(count > 0)
+            count -= gotbytes;
+    }
+    rv = 0;
+
+done:
+    if(!direct) {
+        int saved = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        errno = saved;
+    }
+    return rv;
+}
+
+static int filewrapper_linux_transfer(int infd, int outfd, off_t offset, off_t length,
+                                      off_t *sent) {
+    struct stat statinfo;
+
     if(fstat(infd, &statinfo) < 0)
         return -1;
 
-    remaining = statinfo.st_size - offset;
-    while(remaining > 0) {
-        ssize_t gotbytes = sendfile(outfd, infd, &offset, remaining);
-        if(gotbytes < 0 && (errno != EINTR && errno != EAGAIN)) {
-            /* TODO spit out an error */
-            break;
+    if(S_ISREG(statinfo.st_mode)) {
+        off_t count;
+
+        if(offset < 0) {
+            offset = lseek(infd, 0, SEEK_CUR);
+            if(offset < 0)
+                return -1;
         }
-        offset += gotbytes;
-        remaining -= gotbytes;
+
+        count = offset < statinfo.st_size ? statinfo.st_size - offset : 0;
+        if(length >= 0 && length < count)
+            count = length;
+
+        return filewrapper_linux_sendfile(infd, outfd, offset, count, sent);
     }
 
-    return 0;
+    if(offset >= 0 && lseek(infd, offset, SEEK_SET) < 0)
+        return -1;
+
+    return filewrapper_linux_splice(infd, outfd, length, sent);
 }
 #endif
 
+/*
+ * Send the wrapped file from the kernel side.  Returns -1 if nothing was
+ * sent and the caller should iterate the wrapper instead; once anything
+ * has gone out, a failure is reported here and the response is over.
+ */
 static int filewrapper_accel(FileWrapperObject *self, RequestObject *req) {
     int rv = -1;
     int outfd = req->write_fd;
     int infd;
+    off_t offset = self->offset;
+    off_t sent = 0;
+    int err = 0;
 
     infd = PyObject_AsFileDescriptor(self->object);
     if(infd < 0) {
@@ -488,16 +838,40 @@ static int filewrapper_accel(FileWrapperObject *self, RequestObject *req) {
         return -1;
     }
 
+    /* python may have read ahead of the descriptor's own position */
+    if(offset < 0) {
+        PyObject *pos = PyObject_CallMethod(self->object, "tell", NULL);
+        if(pos != NULL) {
+            offset = PyLong_AsLongLong(pos);
+            Py_DECREF(pos);
+        }
+        if(PyErr_Occurred() != NULL) {
+            PyErr_Clear();
+            offset = -1;
+        }
+    }
+
     Py_BEGIN_ALLOW_THREADS
     pie_buffer_flush(&req->resp.buffer);
 
 #ifdef __linux__
-    if(rv < 0)
-        rv = filewrapper_accel_linux_sendfile(infd, outfd);
+    if(rv < 0) {
+        rv = filewrapper_linux_transfer(infd, outfd, offset, self->length, &sent);
+        err = errno;
+    }
 #endif
     Py_END_ALLOW_THREADS
 
-    return rv;
+    if(rv < 0 && sent == 0 && (err == EINVAL || err == ENOSYS || err == ESPIPE))
+        return -1;
+
+    if(rv < 0) {
+        request_print_info(req);
+        PySys_WriteStderr("File transfer failed after %lld bytes: %s\n",
+                          (long long)sent, strerror(err));
+    }
+
+    return 0;
 }
 
 static PyMethodDef FileWrapperMethods[] = {
@@ -506,51 +880,27 @@ static PyMethodDef FileWrapperMethods[] = {
     {NULL, NULL, 0, NULL},
 };
 
-static PyTypeObject FileWrapperType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "scgi_pie.FileWrapper",    /*tp_name*/
-    sizeof(FileWrapperObject), /*tp_basicsize*/
-    0,                         /*tp_itemsize*/
-    (destructor)filewrapper_dealloc, /*tp_dealloc*/
-    0,                         /*tp_print*/
-    0,                         /*tp_getattr*/
-    0,                         /*tp_setattr*/
-    0,                         /*tp_compare*/
-    0,                         /*tp_repr*/
-    0,                         /*tp_as_number*/
-    0,                         /*tp_as_sequence*/
-    0,                         /*tp_as_mapping*/
-    0,                         /*tp_hash */
-    0,                         /*tp_call*/
-    0,                         /*tp_str*/
-    0,                         /*tp_getattro*/
-    0,                         /*tp_setattro*/
-    0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
-    "wsgi.file_wrapper",       /*tp_doc */
-    0,                         /*tp_traverse */
-    0,                         /*tp_clear */
-    0,                         /*tp_richcompare */
-    0,                         /*tp_weaklistoffset */
-    (getiterfunc)filewrapper_iter,   /*tp_iter */
-    (iternextfunc)filewrapper_iternext, /*tp_iternext */
-    FileWrapperMethods,        /*tp_methods */
-    0,                         /*tp_members*/
-    0,                         /*tp_getset*/
-    0,                         /*tp_base*/
-    0,                         /*tp_dict*/
-    0,                         /*tp_descr_get*/
-    0,                         /*tp_descr_set*/
-    0,                         /*tp_dictoffset*/
-    (initproc)filewrapper_init,/*tp_init*/
-    0,                         /*tp_alloc*/
-    filewrapper_new,           /*tp_new*/
-    0,                         /*tp_free*/
-    0,                         /*tp_is_gc*/
+static PyType_Slot FileWrapperSlots[] = {
+    {Py_tp_dealloc, (void *)filewrapper_dealloc},
+    {Py_tp_doc, "wsgi.file_wrapper"},
+    {Py_tp_iter, (void *)filewrapper_iter},
+    {Py_tp_iternext, (void *)filewrapper_iternext},
+    {Py_tp_methods, FileWrapperMethods},
+    {Py_tp_init, (void *)filewrapper_init},
+    {Py_tp_new, (void *)filewrapper_new},
+    {0, NULL}
+};
+
+static PyType_Spec FileWrapperSpec = {
+    "scgi_pie.FileWrapper",    /*name*/
+    sizeof(FileWrapperObject), /*basicsize*/
+    0,                         /*itemsize*/
+    Py_TPFLAGS_DEFAULT,        /*flags*/
+    FileWrapperSlots,          /*slots*/
 };
 
 static int filewrapper_TypeCheck(PyObject *self) {
-    return PyObject_TypeCheck(self, &FileWrapperType);
+    return Py_TYPE(self)->tp_dealloc == filewrapper_dealloc;
 }
 
 /*
@@ -562,63 +912,257 @@ static PyObject *request_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 
     req = (RequestObject *)type->tp_alloc(type, 0);
     if(req != NULL) {
+        req->state = pie_state_from_type(type);
         req->write_fd = req->read_fd = -1;
 
         req->loop_state.quitting = 0;
+        req->loop_state.halted = NULL;
         req->loop_state.in_accept = 0;
         req->loop_state.thread_id = 0;
 
         req->loop_state.application = NULL;
+        req->loop_state.environ_template = NULL;
+        req->loop_state.lazy_environ = 0;
+        req->loop_state.coalesce = 0;
+        req->loop_state.compress_level = 0;
+        req->loop_state.compress_min_size = DEFAULT_COMPRESS_MIN;
         req->loop_state.allow_buffering = 0;
+        req->loop_state.cork_size = 0;
+        req->loop_state.cork_delay = 0;
+        req->loop_state.tcp_cork = -1;
+        static_files_init(&req->loop_state.static_files, &fd_cache);
+        req->loop_state.cache_vary.names = NULL;
+        req->loop_state.cache_vary.count = 0;
         req->loop_state.listen_fd = -1;
+        req->loop_state.frontend = NULL;
+        req->loop_state.worker_pool = NULL;
 
         req->req.input = NULL;
+        req->req.cache_key = NULL;
+        req->req.cache_key_len = -1;
+        req->req.flight = NULL;
+        req->req.encoding = ENCODING_IDENTITY;
         req->resp.headers_sent = 0;
+        req->resp.compressing = 0;
+        req->resp.no_compress = 0;
+        req->resp.broken = 0;
+        req->resp.vary_encoding = 0;
+        compressor_init(&req->resp.compressor, Z_DEFAULT_COMPRESSION);
+        req->resp.corked = 0;
+        req->resp.capturing = 0;
+        req->resp.capture = NULL;
+        req->resp.capture_len = req->resp.capture_size = 0;
         req->resp.status = NULL;
         req->resp.headers = NULL;
 
+        pie_buffer_pool_init(&req->pool, DEFAULT_POOL_SIZE);
+
         pie_buffer_init(&req->req.buffer);
+        pie_buffer_set_pool(&req->req.buffer, &req->pool);
         pie_buffer_set_reader(&req->req.buffer, req_buffer_do_read, req);
 
         pie_buffer_init(&req->resp.buffer);
+        pie_buffer_set_pool(&req->resp.buffer, &req->pool);
         pie_buffer_set_writer(&req->resp.buffer, resp_buffer_do_write, req);
     }
 
     return (PyObject *)req;
 }
 
+/* static_files is a sequence of (url prefix, directory) pairs */
+static int request_add_static_files(RequestObject *req, PyObject *static_files) {
+    PyObject *seq;
+    Py_ssize_t i;
+
+    seq = PySequence_Fast(static_files, "static_files must be a sequence");
+    if(seq == NULL)
+        return -1;
+
+    for(i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        const char *prefix, *dir;
+
+        if(!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "ss;static_files entries "
+                             "must be (prefix, directory) pairs", &prefix, &dir)) {
+            Py_DECREF(seq);
+            return -1;
+        }
+        if(static_files_add(&req->loop_state.static_files, prefix, dir) < 0) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, dir);
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+
+    Py_DECREF(seq);
+    return 0;
+}
+
+/* response_cache_vary is a sequence of request header names */
+static int request_add_cache_vary(RequestObject *req, PyObject *names) {
+    PyObject *seq;
+    Py_ssize_t i;
+
+    seq = PySequence_Fast(names, "response_cache_vary must be a sequence");
+    if(seq == NULL)
+        return -1;
+
+    for(i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        const char *name = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+
+        if(name == NULL) {
+            Py_DECREF(seq);
+            return -1;
+        }
+        if(resp_cache_vary_add(&req->loop_state.cache_vary, name) < 0) {
+            PyErr_Format(PyExc_ValueError, "bad response_cache_vary header %s", name);
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+
+    Py_DECREF(seq);
+    return 0;
+}
+
 static int request_init(PyObject *self, PyObject *args, PyObject *kwds) {
     RequestObject *req = (RequestObject *)self;
     static char *kwlist[] = {
         "application", "listen_socket",
-        "allow_buffering", "buffer_size", NULL };
+        "allow_buffering", "buffer_size", "pool_size", "lazy_environ",
+        "cork_size", "cork_delay", "static_files", "fd_cache_size", "fd_cache_ttl",
+        "response_cache_size", "response_cache_vary", "coalesce",
+        "compress_level", "compress_min_size", "frontend", "multithread", "multiprocess",
+        "worker_pool", NULL };
     int buffer_size = 0;
-
-    if(!PyArg_ParseTupleAndKeywords(args, kwds, "Oip|i", kwlist,
-                                    &req->loop_state.application,
+    int pool_size = -1;
+    PyObject *static_files = NULL;
+    int fd_cache_size = DEFAULT_FD_CACHE_SIZE;
+    int fd_cache_ttl = DEFAULT_FD_CACHE_TTL;
+    Py_ssize_t response_cache_size = 0;
+    PyObject *response_cache_vary = NULL;
+    PyObject *frontend = NULL;
+    int multithread = 1;
+    int multiprocess = 0;
+    PyObject *worker_pool = NULL;
+    PyObject *application;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "Oip|iipiiOiinOpiiOppO", kwlist,
+                                    &application,
                                     &req->loop_state.listen_fd,
                                     &req->loop_state.allow_buffering,
-                                    &buffer_size))
+                                    &buffer_size,
+                                    &pool_size,
+                                    &req->loop_state.lazy_environ,
+                                    &req->loop_state.cork_size,
+                                    &req->loop_state.cork_delay,
+                                    &static_files,
+                                    &fd_cache_size,
+                                    &fd_cache_ttl,
+                                    &response_cache_size,
+                                    &response_cache_vary,
+                                    &req->loop_state.coalesce,
+                                    &req->loop_state.compress_level,
+                                    &req->loop_state.compress_min_size,
+                                    &frontend,
+                                    &multithread,
+                                    &multiprocess,
+                                    &worker_pool))
         return -1; 
 
+    /* dealloc lets go of it, and Requests can be freed while the server runs */
+    Py_INCREF(application);
+    Py_XSETREF(req->loop_state.application, application);
+
+    if(frontend == Py_None)
+        frontend = NULL;
+    if(frontend != NULL && !frontend_TypeCheck(frontend)) {
+        PyErr_SetString(PyExc_TypeError, "expected frontend object");
+        return -1;
+    }
+    Py_XINCREF(frontend);
+    Py_XSETREF(req->loop_state.frontend, (FrontendObject *)frontend);
+
+    if(worker_pool == Py_None)
+        worker_pool = NULL;
+    if(worker_pool != NULL && !worker_pool_TypeCheck(worker_pool)) {
+        PyErr_SetString(PyExc_TypeError, "expected worker pool object");
+        return -1;
+    }
+    Py_XINCREF(worker_pool);
+    Py_XSETREF(req->loop_state.worker_pool, (WorkerPoolObject *)worker_pool);
+
     if(buffer_size >= 1024) {
         pie_buffer_set_maxsize(&req->req.buffer, buffer_size);
         pie_buffer_set_maxsize(&req->resp.buffer, buffer_size);
     }
 
+    if(pool_size >= 0)
+        req->pool.max_retained = pool_size;
+
+    if(req->loop_state.cork_size < 0)
+        req->loop_state.cork_size = 0;
+    if(req->loop_state.cork_delay < 0)
+        req->loop_state.cork_delay = 0;
+
+    if(req->loop_state.compress_level > 9)
+        req->loop_state.compress_level = 9;
+    compressor_free(&req->resp.compressor);
+    compressor_init(&req->resp.compressor, req->loop_state.compress_level);
+
+    static_files_free(&req->loop_state.static_files);
+    if(static_files != NULL && static_files != Py_None) {
+        if(request_add_static_files(req, static_files) < 0)
+            return -1;
+    }
+
+    /* shared by every thread, so the last one configured wins */
+    if(fd_cache_configure(&fd_cache, fd_cache_size, fd_cache_ttl) < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if(resp_cache_configure(&resp_cache, response_cache_size > 0 ? response_cache_size : 0) < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    resp_cache_vary_free(&req->loop_state.cache_vary);
+    if(response_cache_vary != NULL && response_cache_vary != Py_None) {
+        if(request_add_cache_vary(req, response_cache_vary) < 0)
+            return -1;
+    }
+
+    Py_XDECREF(req->loop_state.environ_template);
+    req->loop_state.environ_template = environ_template_new(req->state, multithread, multiprocess);
+    if(req->loop_state.environ_template == NULL)
+        return -1;
+
     return 0;
 }
 
 static void request_dealloc(PyObject* self) {
     RequestObject *req = (RequestObject *)self;
+    PyTypeObject *type;
 
     Py_CLEAR(req->loop_state.application);
+    Py_CLEAR(req->loop_state.environ_template);
+    Py_CLEAR(req->loop_state.frontend);
+    Py_CLEAR(req->loop_state.worker_pool);
     Py_CLEAR(req->req.input);
     Py_CLEAR(req->resp.status);
     Py_CLEAR(req->resp.headers);
 
+    static_files_free(&req->loop_state.static_files);
+    resp_cache_vary_free(&req->loop_state.cache_vary);
+    free(req->req.cache_key);
+    free(req->resp.capture);
+    compressor_free(&req->resp.compressor);
     pie_buffer_free_data(&req->req.buffer);
     pie_buffer_free_data(&req->resp.buffer);
+    pie_buffer_pool_free(&req->pool);
+
+    type = Py_TYPE(self);
+    type->tp_free(self);
+    Py_DECREF(type);
 }
 
 static PyObject *request_start_response(PyObject *self, PyObject *args, PyObject *keywds) {
@@ -689,98 +1233,462 @@ static PyObject *request_start_response(PyObject *self, PyObject *args, PyObject
     return PyObject_GetAttrString(self, "write");
 }
 
-static int request_send_headers(RequestObject *req) {
-    int i;
-    PyObject *item;
-    PyObject *name, *value;
-    PyObject *headers;
-    PyObject *status;
+/*
+ * Response Capture
+ *
+ * A copy of the response is kept while sending it, as long as it may still
+ * go into the response cache, or out to requests waiting on this one.
+ */
 
-    if(req->resp.headers_sent) {
-        return 0;
-    }
+static void request_capture_start(RequestObject *req, int cacheable) {
+    size_t max = 0;
 
-    headers = req->resp.headers;
-    status = req->resp.status;
-    if(headers == NULL || status == NULL) {
-        PyErr_SetString(PyExc_RuntimeError, "start_response never called with headers");
-        return -1;
+    req->resp.cacheable = cacheable;
+    req->resp.shareable = req->req.flight != NULL;
+    if(cacheable)
+        max = resp_cache_max_entry(&resp_cache);
+    if(req->resp.shareable && max < MAX_SHARED_SIZE)
+        max = MAX_SHARED_SIZE;
+
+    req->resp.capturing = req->resp.cacheable || req->resp.shareable;
+    req->resp.capture_ttl = -1;
+    req->resp.capture_len = 0;
+    req->resp.capture_max = max;
+}
+
+static void request_capture_stop(RequestObject *req) {
+    req->resp.capturing = 0;
+    req->resp.cacheable = 0;
+    req->resp.shareable = 0;
+    req->resp.capture_len = 0;
+}
+
+static void request_capture(RequestObject *req, const char *data, size_t len) {
+    size_t need = req->resp.capture_len + len;
+
+    if(!req->resp.capturing)
+        return;
+    if(need > req->resp.capture_max) {
+        request_capture_stop(req);
+        return;
     }
 
-    /* send status */
-    pie_buffer_append(&req->resp.buffer, "Status: ", 8);
-    pie_buffer_append(&req->resp.buffer, PyBytes_AS_STRING(status), PyBytes_GET_SIZE(status));
-    pie_buffer_append(&req->resp.buffer, "\r\n", 2);
+    if(need > req->resp.capture_size) {
+        size_t size = req->resp.capture_size ? req->resp.capture_size : 4096;
+        char *capture;
 
-    /* send rest headers */
-    for(i = 0; i < PyList_Size(headers); i++) {
-        item = PyList_GetItem(headers, i);
-    
-        if(!PyTuple_Check(item)) {
-            PyErr_SetString(PyExc_TypeError, "a non-tuple found in headers");
-            return -1;
+        while(size < need)
+            size *= 2;
+        capture = realloc(req->resp.capture, size);
+        if(capture == NULL) {
+            request_capture_stop(req);
+            return;
         }
+        req->resp.capture = capture;
+        req->resp.capture_size = size;
+    }
 
-        if(!PyArg_ParseTuple(item, "OO", &name, &value))
-            return -1;
+    memcpy(req->resp.capture + req->resp.capture_len, data, len);
+    req->resp.capture_len = need;
+}
 
-        name = to_pybytes_latin1(name, "header name");
-        if(name == NULL)
-            return -1;
-     
-        value = to_pybytes_latin1(value, "header value");
-        if(value == NULL) {
-            Py_DECREF(name);
-            return -1;
-        }
-    
-        pie_buffer_append(&req->resp.buffer, PyBytes_AS_STRING(name), PyBytes_GET_SIZE(name));
-        pie_buffer_append(&req->resp.buffer, ": ", 2);
-        pie_buffer_append(&req->resp.buffer, PyBytes_AS_STRING(value), PyBytes_GET_SIZE(value));
-        pie_buffer_append(&req->resp.buffer, "\r\n", 2);
+/* hand a complete response to whoever waits on it, and to the cache */
+static void request_capture_finish(RequestObject *req) {
+    char *data;
 
-        Py_DECREF(name);
-        Py_DECREF(value);
+    if(!req->resp.capturing || !req->resp.headers_sent || req->resp.capture_len == 0)
+        return;
+
+    if(req->resp.shareable) {
+        data = malloc(req->resp.capture_len);
+        if(data != NULL) {
+            memcpy(data, req->resp.capture, req->resp.capture_len);
+            flight_land(&flights, req->req.flight, data, req->resp.capture_len);
+            flight_leave(&flights, req->req.flight);
+            req->req.flight = NULL;
+        }
     }
-    pie_buffer_append(&req->resp.buffer, "\r\n", 2);
 
-    Py_BEGIN_ALLOW_THREADS
-    pie_buffer_flush(&req->resp.buffer);
-    Py_END_ALLOW_THREADS
+    if(req->resp.cacheable) {
+        data = realloc(req->resp.capture, req->resp.capture_len);
+        if(data == NULL)
+            data = req->resp.capture;
 
-    req->resp.headers_sent = 1;
- 
-    return 0;
-}
+        resp_cache_put(&resp_cache, req->req.cache_key, req->req.cache_key_len,
+                       data, req->resp.capture_len, req->resp.capture_ttl);
 
-static PyObject *request_write(PyObject *self, PyObject *args) {
-    PyObject *bytes;
-    RequestObject *req;
+        req->resp.capture = NULL;
+        req->resp.capture_size = 0;
+    }
 
-    if(!request_TypeCheck(self)) {
-        PyErr_SetString(PyExc_TypeError, "expected request object");
-        return NULL;
+    request_capture_stop(req);
+}
+
+static void request_check_cache_header(RequestObject *req, PyObject *name, PyObject *value) {
+    const char *n = PyBytes_AS_STRING(name);
+    Py_ssize_t n_len = PyBytes_GET_SIZE(name);
+    const char *v = PyBytes_AS_STRING(value);
+    Py_ssize_t v_len = PyBytes_GET_SIZE(value);
+
+    if(n_len == 13 && strncasecmp(n, "cache-control", 13) == 0) {
+        req->resp.capture_ttl = resp_cache_ttl(v, v_len);
+        if(req->resp.capture_ttl < 0)
+            req->resp.cacheable = 0;
+        if(!resp_cache_shareable(v, v_len))
+            req->resp.shareable = 0;
+    } else if(n_len == 10 && strncasecmp(n, "set-cookie", 10) == 0) {
+        req->resp.cacheable = req->resp.shareable = 0;
+    } else if(n_len == 4 && strncasecmp(n, "vary", 4) == 0) {
+        if(!resp_cache_vary_covered(&req->loop_state.cache_vary, v, v_len))
+            req->resp.cacheable = req->resp.shareable = 0;
     }
-    req = (RequestObject*)self;
-    
-    if(request_send_headers(req) < 0)
-        return NULL;
 
-    if(!PyArg_ParseTuple(args, "O", &bytes))
-        return NULL;
- 
-    if(!PyBytes_Check(bytes)) {
-        PyErr_Format(PyExc_TypeError, "write got %s, but expected bytes object.",
-                bytes->ob_type->tp_name);
-        return NULL;
+    if(!req->resp.cacheable && !req->resp.shareable)
+        request_capture_stop(req);
+}
+
+static void response_append(RequestObject *req, const char *data, size_t len) {
+    pie_buffer_append(&req->resp.buffer, data, len);
+    request_capture(req, data, len);
+}
+
+/*
+ * Corking
+ */
+
+static long long monotonic_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void request_cork(RequestObject *req) {
+    req->resp.cork_since = 0;
+    req->resp.last_chunk = 0;
+    req->resp.corked = 0;
+
+#ifdef TCP_CORK
+    if(req->loop_state.cork_size > 0 && req->loop_state.tcp_cork != 0) {
+        int on = 1;
+
+        /* every connection comes off the same listener, so only try once */
+        if(setsockopt(req->write_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0)
+            req->resp.corked = 1;
+        req->loop_state.tcp_cork = req->resp.corked;
+    }
+#endif
+}
+
+static void request_uncork(RequestObject *req, int fd) {
+#ifdef TCP_CORK
+    if(req->resp.corked) {
+        int off = 0;
+
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        req->resp.corked = 0;
     }
+#endif
+}
+
+/*
+ * Decide whether a small chunk can wait in the response buffer.  It is held
+ * only while the application keeps producing faster than cork_delay, and
+ * only until cork_size bytes or cork_delay worth of chunks have piled up,
+ * so a slow generator still streams chunk by chunk.
+ */
+static int request_hold_chunk(RequestObject *req, Py_ssize_t len) {
+    long long now = monotonic_usec();
+    long long delay = (long long)req->loop_state.cork_delay * 1000;
+    long long last = req->resp.last_chunk;
+
+    req->resp.last_chunk = now;
+
+    if(last == 0 || now - last >= delay)
+        return 0;
+    if(pie_buffer_size(&req->resp.buffer) + len >= (size_t)req->loop_state.cork_size)
+        return 0;
+
+    if(req->resp.cork_since == 0)
+        req->resp.cork_since = now;
+    else if(now - req->resp.cork_since >= delay)
+        return 0;
+
+    return 1;
+}
+
+/*
+ * Compression
+ */
+
+static int header_is(PyObject *name, const char *want) {
+    const char *n = PyBytes_AS_STRING(name);
+    size_t len = strlen(want);
+
+    return (size_t)PyBytes_GET_SIZE(name) == len && strncasecmp(n, want, len) == 0;
+}
+
+/*
+ * Decide on compressing before any header goes out, as it changes some.
+ * Looks only at well formed str headers; anything else fails later anyway.
+ */
+static void request_compress_decide(RequestObject *req, PyObject *status, PyObject *headers) {
+    const char *code = PyBytes_AS_STRING(status);
+    long long length = -1;
+    int type_ok = 0;
+    Py_ssize_t i;
+
+    req->resp.compressing = 0;
+    req->resp.vary_encoding = 0;
+    if(req->loop_state.compress_level <= 0 || req->resp.no_compress)
+        return;
+    if(code[0] == '1' || strncmp(code, "204", 3) == 0 || strncmp(code, "304", 3) == 0)
+        return;
+    /* a range is of the identity bytes, so compressing would break it */
+    if(strncmp(code, "206", 3) == 0)
+        return;
+
+    for(i = 0; i < PyList_Size(headers); i++) {
+        PyObject *item = PyList_GetItem(headers, i);
+        const char *n, *v;
+        Py_ssize_t n_len, v_len;
+
+        if(!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2 ||
+           !PyUnicode_Check(PyTuple_GET_ITEM(item, 0)) ||
+           !PyUnicode_Check(PyTuple_GET_ITEM(item, 1)))
+            continue;
+
+        n = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(item, 0), &n_len);
+        v = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(item, 1), &v_len);
+        if(n == NULL || v == NULL) {
+            PyErr_Clear();
+            continue;
+        }
+
+        if(n_len == 12 && strncasecmp(n, "content-type", 12) == 0) {
+            type_ok = compress_type_ok(v, v_len);
+        } else if(n_len == 16 && strncasecmp(n, "content-encoding", 16) == 0) {
+            if(strcasecmp(v, "identity") != 0)
+                return;
+        } else if(n_len == 14 && strncasecmp(n, "content-length", 14) == 0) {
+            length = strtoll(v, NULL, 10);
+        } else if(n_len == 13 && strncasecmp(n, "cache-control", 13) == 0) {
+            if(strcasestr(v, "no-transform") != NULL)
+                return;
+        } else if(n_len == 13 && strncasecmp(n, "content-range", 13) == 0) {
+            return;
+        }
+    }
+
+    if(!type_ok)
+        return;
+    req->resp.vary_encoding = 1;
+
+    if(req->req.encoding == ENCODING_IDENTITY)
+        return;
+    if(length >= 0 && length < req->loop_state.compress_min_size)
+        return;
+    if(compressor_start(&req->resp.compressor, req->req.encoding) < 0)
+        return;
+    req->resp.compressing = 1;
+}
+
+static void compress_capture(const char *data, size_t len, void *udata) {
+    request_capture((RequestObject *)udata, data, len);
+}
+
+/*
+ * Compress a piece of the body with the GIL released.  Output goes out
+ * straight away (with a sync flush) unless buffering or corking would
+ * have held the piece back anyway.
+ */
+static int request_send_compressed(RequestObject *req, const char *data, size_t len, int finish) {
+    int hold = 0;
+    int flush;
+    int rv;
+
+    if(!finish)
+        hold = req->loop_state.allow_buffering ||
+               (req->loop_state.cork_size > 0 && request_hold_chunk(req, len));
+    flush = finish ? Z_FINISH : hold ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+
+    Py_BEGIN_ALLOW_THREADS
+    rv = compressor_write(&req->resp.compressor, &req->resp.buffer, data, len, flush,
+                          compress_capture, req);
+    if(rv == 0 && !hold && !finish)
+        pie_buffer_flush(&req->resp.buffer);
+    Py_END_ALLOW_THREADS
+
+    if(rv < 0) {
+        /* a stream cut short would pass for a complete one, so stop here */
+        req->resp.compressing = 0;
+        req->resp.broken = 1;
+        pie_buffer_consume(&req->resp.buffer, pie_buffer_size(&req->resp.buffer));
+        request_capture_stop(req);
+    }
+    return rv;
+}
+
+static int request_send_headers(RequestObject *req) {
+    int i;
+    PyObject *item;
+    PyObject *name, *value;
+    PyObject *headers;
+    PyObject *status;
+    int vary_done = 0;
+
+    if(req->resp.headers_sent) {
+        return 0;
+    }
+
+    headers = req->resp.headers;
+    status = req->resp.status;
+    if(headers == NULL || status == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "start_response never called with headers");
+        return -1;
+    }
+
+    /*
+     * Only plain successes are kept or shared.  Conditional and Range
+     * headers aren't in the key, so a 304 or 206 would be wrong for the
+     * others.
+     */
+    if(req->req.cache_key_len >= 0 && PyBytes_GET_SIZE(status) >= 4 &&
+       memcmp(PyBytes_AS_STRING(status), "200 ", 4) == 0)
+        request_capture_start(req, resp_cache_enabled(&resp_cache));
+
+    request_compress_decide(req, status, headers);
+
+    /* send status */
+    response_append(req, "Status: ", 8);
+    response_append(req, PyBytes_AS_STRING(status), PyBytes_GET_SIZE(status));
+    response_append(req, "\r\n", 2);
+
+    /* send rest headers */
+    for(i = 0; i < PyList_Size(headers); i++) {
+        item = PyList_GetItem(headers, i);
+    
+        if(!PyTuple_Check(item)) {
+            PyErr_SetString(PyExc_TypeError, "a non-tuple found in headers");
+            return -1;
+        }
+
+        if(!PyArg_ParseTuple(item, "OO", &name, &value))
+            return -1;
+
+        name = to_pybytes_latin1(name, "header name");
+        if(name == NULL)
+            return -1;
+     
+        value = to_pybytes_latin1(value, "header value");
+        if(value == NULL) {
+            Py_DECREF(name);
+            return -1;
+        }
     
-    pie_buffer_append(&req->resp.buffer, PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes));
-    if(!req->loop_state.allow_buffering) {
+        if(req->resp.capturing)
+            request_check_cache_header(req, name, value);
+
+        /* the compressed length isn't known up front */
+        if(req->resp.compressing && header_is(name, "content-length")) {
+            Py_DECREF(name);
+            Py_DECREF(value);
+            continue;
+        }
+
+        response_append(req, PyBytes_AS_STRING(name), PyBytes_GET_SIZE(name));
+        response_append(req, ": ", 2);
+        /* the encoded body isn't byte-for-byte what a strong tag names */
+        if(req->resp.compressing && header_is(name, "etag") &&
+           strncmp(PyBytes_AS_STRING(value), "W/", 2) != 0)
+            response_append(req, "W/", 2);
+        response_append(req, PyBytes_AS_STRING(value), PyBytes_GET_SIZE(value));
+        if(req->resp.vary_encoding && header_is(name, "vary")) {
+            if(strcasestr(PyBytes_AS_STRING(value), "accept-encoding") == NULL &&
+               strchr(PyBytes_AS_STRING(value), '*') == NULL)
+                response_append(req, ", Accept-Encoding", 17);
+            vary_done = 1;
+        }
+        response_append(req, "\r\n", 2);
+
+        Py_DECREF(name);
+        Py_DECREF(value);
+    }
+    if(req->resp.compressing) {
+        const char *encoding = compress_encoding_name(req->req.encoding);
+
+        response_append(req, "Content-Encoding: ", 18);
+        response_append(req, encoding, strlen(encoding));
+        response_append(req, "\r\n", 2);
+    }
+    if(req->resp.vary_encoding && !vary_done)
+        response_append(req, "Vary: Accept-Encoding\r\n", 23);
+    response_append(req, "\r\n", 2);
+
+    /* nothing said it may be kept */
+    if(req->resp.capture_ttl < 0)
+        req->resp.cacheable = 0;
+    if(!req->resp.cacheable && !req->resp.shareable)
+        request_capture_stop(req);
+
+    /* left in the buffer, to go out along with the first body chunk */
+    req->resp.headers_sent = 1;
+ 
+    return 0;
+}
+
+/*
+ * Send (or buffer) one piece of the body from anything exposing a
+ * contiguous buffer.  Pieces of DIRECT_WRITE_SIZE or more are never copied
+ * into the response buffer, even when buffering, but written straight
+ * from the object's memory with the GIL released.  The exported buffer
+ * keeps the object from being resized meanwhile.  Returns -1 once the
+ * response can't go on.
+ */
+static int request_send_body(RequestObject *req, Py_buffer *view) {
+    if(req->resp.broken)
+        return -1;
+    if(req->resp.compressing)
+        return request_send_compressed(req, view->buf, view->len, 0);
+
+    request_capture(req, view->buf, view->len);
+
+    if(req->loop_state.allow_buffering && view->len < DIRECT_WRITE_SIZE) {
+        pie_buffer_append(&req->resp.buffer, view->buf, view->len);
+    } else if(req->loop_state.cork_size > 0 && request_hold_chunk(req, view->len)) {
+        pie_buffer_append(&req->resp.buffer, view->buf, view->len);
+    } else {
+        req->resp.cork_since = 0;
+        /* headers (if still buffered) and chunk in one write */
         Py_BEGIN_ALLOW_THREADS
-        pie_buffer_flush(&req->resp.buffer);
+        pie_buffer_flush_with(&req->resp.buffer, view->buf, view->len);
         Py_END_ALLOW_THREADS
     }
+    return 0;
+}
+
+static PyObject *request_write(PyObject *self, PyObject *args) {
+    Py_buffer view;
+    RequestObject *req;
+
+    if(!request_TypeCheck(self)) {
+        PyErr_SetString(PyExc_TypeError, "expected request object");
+        return NULL;
+    }
+    req = (RequestObject*)self;
+    
+    if(request_send_headers(req) < 0)
+        return NULL;
+
+    if(!PyArg_ParseTuple(args, "y*", &view))
+        return NULL;
+
+    if(request_send_body(req, &view) < 0) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_OSError, "compressing the response failed");
+        return NULL;
+    }
+    PyBuffer_Release(&view);
 
     Py_INCREF(Py_None);
     return Py_None;
@@ -795,51 +1703,25 @@ static PyMethodDef RequestMethods[] = {
     {NULL, NULL, 0, NULL},
 };
 
-static PyTypeObject RequestType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "_scgi_pie.Request",        /*tp_name*/
-    sizeof(RequestObject),     /*tp_basicsize*/
-    0,                         /*tp_itemsize*/
-    (destructor)request_dealloc, /*tp_dealloc*/
-    0,                         /*tp_print*/
-    0,                         /*tp_getattr*/
-    0,                         /*tp_setattr*/
-    0,                         /*tp_compare*/
-    0,                         /*tp_repr*/
-    0,                         /*tp_as_number*/
-    0,                         /*tp_as_sequence*/
-    0,                         /*tp_as_mapping*/
-    0,                         /*tp_hash */
-    0,                         /*tp_call*/
-    0,                         /*tp_str*/
-    0,                         /*tp_getattro*/
-    0,                         /*tp_setattro*/
-    0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
-    "Request Object",          /*tp_doc */
-    0,                         /*tp_traverse */
-    0,                         /*tp_clear */
-    0,                         /*tp_richcompare */
-    0,                         /*tp_weaklistoffset */
-    0,                         /*tp_iter */
-    0,                         /*tp_iternext */
-    RequestMethods,            /*tp_methods */
-    0,                         /*tp_members*/
-    0,                         /*tp_getset*/
-    0,                         /*tp_base*/
-    0,                         /*tp_dict*/
-    0,                         /*tp_descr_get*/
-    0,                         /*tp_descr_set*/
-    0,                         /*tp_dictoffset*/
-    request_init,              /*tp_init*/
-    0,                         /*tp_alloc*/
-    request_new,               /*tp_new*/
-    0,                         /*tp_free*/
-    0,                         /*tp_is_gc*/
+static PyType_Slot RequestSlots[] = {
+    {Py_tp_dealloc, (void *)request_dealloc},
+    {Py_tp_doc, "Request Object"},
+    {Py_tp_methods, RequestMethods},
+    {Py_tp_init, (void *)request_init},
+    {Py_tp_new, (void *)request_new},
+    {0, NULL}
+};
+
+static PyType_Spec RequestSpec = {
+    "_scgi_pie.Request",       /*name*/
+    sizeof(RequestObject),     /*basicsize*/
+    0,                         /*itemsize*/
+    Py_TPFLAGS_DEFAULT,        /*flags*/
+    RequestSlots,              /*slots*/
 };
 
 static int request_TypeCheck(PyObject *self) {
-    return PyObject_TypeCheck(self, &RequestType);
+    return Py_TYPE(self)->tp_dealloc == request_dealloc;
 }
 
 static void request_print_info(RequestObject *req) {
@@ -859,14 +1741,23 @@ static void request_print_info(RequestObject *req) {
 
     if(req->req.environ != NULL) {
         PyObject *value;
+        PyObject *type, *exc, *tb;
 
-        value = PyDict_GetItemString(req->req.environ, "SCRIPT_NAME");
+        /* keep whatever error we are about to report */
+        PyErr_Fetch(&type, &exc, &tb);
+
+        value = PyMapping_GetItemString(req->req.environ, "SCRIPT_NAME");
         if(value != NULL && PyUnicode_Check(value))
             PySys_FormatStderr(" SN=%s", PyUnicode_AsUTF8(value));
+        Py_XDECREF(value);
 
-        value = PyDict_GetItemString(req->req.environ, "PATH_INFO");
+        value = PyMapping_GetItemString(req->req.environ, "PATH_INFO");
         if(value != NULL && PyUnicode_Check(value))
             PySys_FormatStderr(" PI=%s", PyUnicode_AsUTF8(value));
+        Py_XDECREF(value);
+
+        PyErr_Clear();
+        PyErr_Restore(type, exc, tb);
     }
 
     PySys_WriteStderr("\n");
@@ -892,107 +1783,660 @@ static void send_error(RequestObject *req, const char *error) {
     pie_buffer_flush(&req->resp.buffer);
 }
 
-static int load_headers(RequestObject *req, char ** headers) {
-    PieBuffer *buffer = &req->req.buffer;
-    int header_size = 0;
-    int c = '\0';
+static int strntol(const char *str, size_t maxlen) {
+    int value = 0;
+    const char *end = str + maxlen;
+    while(str < end && *str >= '0' && *str <= '9') {
+        value = value * 10 + (*str - '0');
+        str++;
+    }
+    return value;
+}
+
+/*
+ * Environ Keys
+ *
+ * Keys for well known CGI and HTTP variables are interned once at import,
+ * so they are never rebuilt or rehashed per request.  They are found with a
+ * perfect hash over the name length and three of its characters.  The
+ * multipliers were found by brute force search for this set of names, so
+ * adding a name may need a new search; a collision fails the import.
+ */
+
+enum {
+    ENV_PLAIN,
+    ENV_HTTPS,
+    ENV_CONTENT_TYPE,
+    ENV_CONTENT_LENGTH,
+    ENV_HOST
+};
+
+typedef struct {
+    const char *name;
+    size_t len;
+    int kind;
+} EnvironKey;
+
+static EnvironKey environ_keys[ENVIRON_KEYS_SIZE] = {
+    [  0] = {"HTTP_IF_MODIFIED_SINCE", 22, ENV_PLAIN},
+    [  3] = {"HTTP_ACCEPT_LANGUAGE", 20, ENV_PLAIN},
+    [ 15] = {"HTTP_PRAGMA", 11, ENV_PLAIN},
+    [ 16] = {"HTTPS", 5, ENV_HTTPS},
+    [ 17] = {"DOCUMENT_ROOT", 13, ENV_PLAIN},
+    [ 22] = {"HTTP_HOST", 9, ENV_HOST},
+    [ 23] = {"QUERY_STRING", 12, ENV_PLAIN},
+    [ 24] = {"HTTP_TE", 7, ENV_PLAIN},
+    [ 32] = {"HTTP_IF_NONE_MATCH", 18, ENV_PLAIN},
+    [ 34] = {"REMOTE_USER", 11, ENV_PLAIN},
+    [ 36] = {"HTTP_REFERER", 12, ENV_PLAIN},
+    [ 38] = {"HTTP_X_FORWARDED_HOST", 21, ENV_PLAIN},
+    [ 40] = {"HTTP_ACCEPT_ENCODING", 20, ENV_PLAIN},
+    [ 41] = {"HTTP_ACCEPT_CHARSET", 19, ENV_PLAIN},
+    [ 42] = {"CONTENT_TYPE", 12, ENV_PLAIN},
+    [ 45] = {"SERVER_SOFTWARE", 15, ENV_PLAIN},
+    [ 46] = {"SCGI", 4, ENV_PLAIN},
+    [ 52] = {"HTTP_CONTENT_TYPE", 17, ENV_CONTENT_TYPE},
+    [ 60] = {"HTTP_X_FORWARDED_FOR", 20, ENV_PLAIN},
+    [ 61] = {"HTTP_UPGRADE_INSECURE_REQUESTS", 30, ENV_PLAIN},
+    [ 63] = {"HTTP_ACCEPT", 11, ENV_PLAIN},
+    [ 65] = {"REMOTE_PORT", 11, ENV_PLAIN},
+    [ 67] = {"HTTP_X_FORWARDED_PROTO", 22, ENV_PLAIN},
+    [ 68] = {"REQUEST_METHOD", 14, ENV_PLAIN},
+    [ 69] = {"HTTP_X_REAL_IP", 14, ENV_PLAIN},
+    [ 71] = {"HTTP_CONTENT_LENGTH", 19, ENV_CONTENT_LENGTH},
+    [ 77] = {"HTTP_USER_AGENT", 15, ENV_PLAIN},
+    [ 78] = {"SERVER_PORT", 11, ENV_PLAIN},
+    [ 80] = {"HTTP_ORIGIN", 11, ENV_PLAIN},
+    [ 81] = {"HTTP_CONNECTION", 15, ENV_PLAIN},
+    [ 85] = {"PATH_INFO", 9, ENV_PLAIN},
+    [ 87] = {"CONTENT_LENGTH", 14, ENV_CONTENT_LENGTH},
+    [ 88] = {"HTTP_AUTHORIZATION", 18, ENV_PLAIN},
+    [ 89] = {"HTTP_DNT", 8, ENV_PLAIN},
+    [ 91] = {"HTTP_X_REQUESTED_WITH", 21, ENV_PLAIN},
+    [ 94] = {"HTTP_COOKIE", 11, ENV_PLAIN},
+    [ 98] = {"HTTP_CACHE_CONTROL", 18, ENV_PLAIN},
+    [ 99] = {"REMOTE_ADDR", 11, ENV_PLAIN},
+    [103] = {"SERVER_PROTOCOL", 15, ENV_PLAIN},
+    [105] = {"SERVER_NAME", 11, ENV_PLAIN},
+    [107] = {"SCRIPT_NAME", 11, ENV_PLAIN},
+    [109] = {"HTTP_RANGE", 10, ENV_PLAIN},
+    [112] = {"SERVER_ADDR", 11, ENV_PLAIN},
+    [118] = {"GATEWAY_INTERFACE", 17, ENV_PLAIN},
+    [122] = {"DOCUMENT_URI", 12, ENV_PLAIN},
+    [124] = {"REQUEST_SCHEME", 14, ENV_PLAIN},
+    [125] = {"REQUEST_URI", 11, ENV_PLAIN},
+};
+
+static unsigned int environ_key_hash(const char *name, size_t len) {
+    return (len * 2 +
+            (unsigned char)name[len-1] * 54 +
+            (unsigned char)name[len-2] * 63 +
+            (unsigned char)name[len/2]) & (ENVIRON_KEYS_SIZE - 1);
+}
+
+static EnvironKey *environ_key_lookup(const char *name, size_t len) {
+    EnvironKey *k;
+
+    if(len < 2)
+        return NULL;
+
+    k = &environ_keys[environ_key_hash(name, len)];
+    if(k->len == len && !memcmp(k->name, name, len))
+        return k;
+    return NULL;
+}
 
-    while(c != ':') {
-        c = pie_buffer_getchar(buffer);
-        if(c < 0) {
-            send_error(req, "Problems getting SCGI header size");
+/* the interned key object, kept in the module state */
+#define KEY_OBJECT(st, k)    ((st)->environ_keys[(k) - environ_keys])
+#define KNOWN_KEY(st, name)  KEY_OBJECT(st, environ_key_lookup(name, sizeof(name)-1))
+
+static int environ_keys_init(PieState *st) {
+    int i;
+
+    st->str_wsgi_input = PyUnicode_InternFromString("wsgi.input");
+    st->str_wsgi_run_once = PyUnicode_InternFromString("wsgi.run_once");
+    st->str_wsgi_url_scheme = PyUnicode_InternFromString("wsgi.url_scheme");
+    st->str_http = PyUnicode_InternFromString("http");
+    st->str_https = PyUnicode_InternFromString("https");
+    if(st->str_wsgi_input == NULL || st->str_wsgi_run_once == NULL ||
+       st->str_wsgi_url_scheme == NULL || st->str_http == NULL || st->str_https == NULL)
+        return -1;
+
+    for(i = 0; i < ENVIRON_KEYS_SIZE; i++) {
+        EnvironKey *k = &environ_keys[i];
+        if(k->name == NULL)
+            continue;
+
+        if(k->len != strlen(k->name) || environ_key_hash(k->name, k->len) != (unsigned int)i) {
+            PyErr_Format(PyExc_SystemError, "environ key %s is misplaced", k->name);
             return -1;
         }
-    
-        if(c >= '0' && c <= '9')
-            header_size = header_size * 10 + (c - '0');
+
+        st->environ_keys[i] = PyUnicode_InternFromString(k->name);
+        if(st->environ_keys[i] == NULL)
+            return -1;
     }
 
-    if(pie_buffer_getptr(buffer, headers, header_size) <= 0) {
-        send_error(req, "Problems getting SCGI headers");
-        return -1;
+    return 0;
+}
+
+static void environ_set(PyObject *environ, const ScgiHeader *h, PyObject *value) {
+    PyObject *key;
+
+    key = PyUnicode_DecodeLatin1(h->name, h->name_len, "replace");
+    if(key != NULL) {
+        PyDict_SetItem(environ, key, value);
+        Py_DECREF(key);
     }
+}
+
+/*
+ * Lazy Environ
+ *
+ * A dict subclass that keeps a copy of the raw SCGI header block and only
+ * decodes a header into the dict when it is looked up by key.  Anything
+ * that needs the whole mapping (iteration, len(), keys(), copies, ...)
+ * decodes everything still pending first, so it always behaves like the
+ * plain dict it would otherwise have been.
+ */
+
+typedef struct {
+    PyObject *key;          /* interned key, or NULL to decode the name */
+    Py_ssize_t name;        /* offsets into raw */
+    Py_ssize_t name_len;    /* -1 once resolved */
+    Py_ssize_t value;
+    Py_ssize_t value_len;
+} PendingHeader;
+
+typedef struct {
+    PyDictObject dict;
 
-    return header_size;
+    PyObject *raw;
+    PendingHeader *pending;
+    int pending_count;
+    int pending_live;
+} EnvironObject;
+
+static void environ_dealloc(PyObject *self);
+
+static int environ_Check(PyObject *o) {
+    return Py_TYPE(o)->tp_dealloc == environ_dealloc;
 }
 
-static int strntol(const char *str, size_t maxlen) {
-    int value = 0;
-    const char *end = str + maxlen;
-    while(str < end && *str >= '0' && *str <= '9') {
-        value = value * 10 + (*str - '0');
-        str++;
+static int environ_key_bytes(PyObject *key, const char **name, Py_ssize_t *len) {
+    /* header names were decoded as latin-1, so only 1-byte strings match */
+    if(!PyUnicode_Check(key) || PyUnicode_KIND(key) != PyUnicode_1BYTE_KIND)
+        return 0;
+
+    *name = (const char *)PyUnicode_1BYTE_DATA(key);
+    *len = PyUnicode_GET_LENGTH(key);
+    return 1;
+}
+
+static void environ_drop_pending(EnvironObject *self, PyObject *key) {
+    const char *name, *raw;
+    Py_ssize_t len;
+    int i;
+
+    if(self->pending_live == 0 || !environ_key_bytes(key, &name, &len))
+        return;
+
+    raw = PyBytes_AS_STRING(self->raw);
+    for(i = 0; i < self->pending_count; i++) {
+        PendingHeader *p = &self->pending[i];
+        if(p->name_len == len && !memcmp(raw + p->name, name, len)) {
+            p->name_len = -1;
+            self->pending_live--;
+        }
+    }
+}
+
+static void environ_defer(EnvironObject *self, const ScgiHeaders *headers,
+                          const ScgiHeader *h, PyObject *known) {
+    PendingHeader *p = &self->pending[self->pending_count++];
+
+    p->key = known;
+    p->name = h->name - headers->block;
+    p->name_len = h->name_len;
+    p->value = h->value - headers->block;
+    p->value_len = h->value_len;
+    self->pending_live++;
+
+    /* a later header replaces an earlier value, including template defaults */
+    if(known != NULL && PyDict_Contains((PyObject*)self, known) > 0)
+        PyDict_DelItem((PyObject*)self, known);
+}
+
+/*
+ * Decode the pending header for key into the dict.  Returns a borrowed
+ * reference, or NULL if nothing is pending for key (or on error).
+ */
+static PyObject *environ_resolve(EnvironObject *self, PyObject *key) {
+    const char *name, *raw;
+    Py_ssize_t len;
+    PendingHeader *p = NULL;
+    PyObject *value;
+    int i;
+
+    if(self->pending_live == 0 || !environ_key_bytes(key, &name, &len))
+        return NULL;
+
+    raw = PyBytes_AS_STRING(self->raw);
+    for(i = self->pending_count - 1; i >= 0; i--) {
+        p = &self->pending[i];
+        if(p->name_len == len && !memcmp(raw + p->name, name, len))
+            break;
+    }
+    if(i < 0)
+        return NULL;
+
+    value = PyUnicode_DecodeLatin1(raw + p->value, p->value_len, "replace");
+    if(value == NULL)
+        return NULL;
+
+    environ_drop_pending(self, key);
+    if(PyDict_SetItem((PyObject*)self, key, value) < 0) {
+        Py_DECREF(value);
+        return NULL;
     }
+
+    Py_DECREF(value);
     return value;
 }
 
-static PyObject *setup_environ(RequestObject *req, char * headers, int header_size) {
+static int environ_materialize(EnvironObject *self) {
+    const char *raw;
+    PyObject *key, *value;
+    int i;
+
+    if(self->pending_live > 0) {
+        raw = PyBytes_AS_STRING(self->raw);
+        for(i = 0; i < self->pending_count; i++) {
+            PendingHeader *p = &self->pending[i];
+            if(p->name_len < 0)
+                continue;
+
+            if(p->key != NULL) {
+                key = p->key;
+                Py_INCREF(key);
+            } else {
+                key = PyUnicode_DecodeLatin1(raw + p->name, p->name_len, "replace");
+                if(key == NULL)
+                    return -1;
+            }
+
+            value = PyUnicode_DecodeLatin1(raw + p->value, p->value_len, "replace");
+            if(value == NULL || PyDict_SetItem((PyObject*)self, key, value) < 0) {
+                Py_DECREF(key);
+                Py_XDECREF(value);
+                return -1;
+            }
+            Py_DECREF(key);
+            Py_DECREF(value);
+
+            p->name_len = -1;
+            self->pending_live--;
+        }
+    }
+
+    PyMem_Free(self->pending);
+    self->pending = NULL;
+    self->pending_count = 0;
+    self->pending_live = 0;
+    Py_CLEAR(self->raw);
+
+    return 0;
+}
+
+static PyObject *environ_lookup(EnvironObject *self, PyObject *key) {
+    PyObject *value;
+
+    value = PyDict_GetItemWithError((PyObject*)self, key);
+    if(value != NULL || PyErr_Occurred())
+        return value;
+
+    return environ_resolve(self, key);
+}
+
+static PyObject *environ_subscript(PyObject *self, PyObject *key) {
+    PyObject *value;
+
+    value = environ_lookup((EnvironObject*)self, key);
+    if(value == NULL) {
+        if(!PyErr_Occurred())
+            PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    Py_INCREF(value);
+    return value;
+}
+
+static int environ_ass_subscript(PyObject *self, PyObject *key, PyObject *value) {
+    if(value == NULL) {
+        /* deleting a pending key must still find it */
+        if(environ_lookup((EnvironObject*)self, key) == NULL && PyErr_Occurred())
+            return -1;
+        return PyDict_DelItem(self, key);
+    }
+
+    environ_drop_pending((EnvironObject*)self, key);
+    return PyDict_SetItem(self, key, value);
+}
+
+static int environ_contains(PyObject *self, PyObject *key) {
+    if(environ_lookup((EnvironObject*)self, key) != NULL)
+        return 1;
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static Py_ssize_t environ_length(PyObject *self) {
+    if(environ_materialize((EnvironObject*)self) < 0)
+        return -1;
+    return PyDict_Type.tp_as_mapping->mp_length(self);
+}
+
+static PyObject *environ_iter(PyObject *self) {
+    if(environ_materialize((EnvironObject*)self) < 0)
+        return NULL;
+    return PyDict_Type.tp_iter(self);
+}
+
+static PyObject *environ_repr(PyObject *self) {
+    if(environ_materialize((EnvironObject*)self) < 0)
+        return NULL;
+    return PyDict_Type.tp_repr(self);
+}
+
+static PyObject *environ_richcompare(PyObject *self, PyObject *other, int op) {
+    if(environ_materialize((EnvironObject*)self) < 0)
+        return NULL;
+    if(environ_Check(other) &&
+       environ_materialize((EnvironObject*)other) < 0)
+        return NULL;
+    return PyDict_Type.tp_richcompare(self, other, op);
+}
+
+static PyObject *environ_get(PyObject *self, PyObject *args) {
+    PyObject *key, *value;
+    PyObject *def = Py_None;
+
+    if(!PyArg_ParseTuple(args, "O|O:get", &key, &def))
+        return NULL;
+
+    value = environ_lookup((EnvironObject*)self, key);
+    if(value == NULL) {
+        if(PyErr_Occurred())
+            return NULL;
+        value = def;
+    }
+
+    Py_INCREF(value);
+    return value;
+}
+
+/*
+ * Everything else decodes all pending headers and defers to dict.
+ */
+static PyObject *environ_call_dict(PyObject *self, const char *name, PyObject *args, PyObject *kwargs) {
+    PyObject *method, *fullargs, *result;
+    Py_ssize_t i, n;
+
+    if(environ_materialize((EnvironObject*)self) < 0)
+        return NULL;
+
+    method = PyObject_GetAttrString((PyObject*)&PyDict_Type, name);
+    if(method == NULL)
+        return NULL;
+
+    n = PyTuple_GET_SIZE(args);
+    fullargs = PyTuple_New(n + 1);
+    if(fullargs == NULL) {
+        Py_DECREF(method);
+        return NULL;
+    }
+
+    Py_INCREF(self);
+    PyTuple_SET_ITEM(fullargs, 0, self);
+    for(i = 0; i < n; i++) {
+        PyObject *item = PyTuple_GET_ITEM(args, i);
+        Py_INCREF(item);
+        PyTuple_SET_ITEM(fullargs, i + 1, item);
+    }
+
+    result = PyObject_Call(method, fullargs, kwargs);
+    Py_DECREF(fullargs);
+    Py_DECREF(method);
+    return result;
+}
+
+/* dict takes no keywords for these, so neither do we */
+#define ENVIRON_FORWARD(name) \
+    static PyObject *environ_dict_##name(PyObject *self, PyObject *args) { \
+        return environ_call_dict(self, #name, args, NULL); \
+    }
+
+ENVIRON_FORWARD(keys)
+ENVIRON_FORWARD(items)
+ENVIRON_FORWARD(values)
+ENVIRON_FORWARD(copy)
+ENVIRON_FORWARD(pop)
+ENVIRON_FORWARD(popitem)
+ENVIRON_FORWARD(setdefault)
+ENVIRON_FORWARD(clear)
+ENVIRON_FORWARD(__reversed__)
+
+static PyObject *environ_dict_update(PyObject *self, PyObject *args, PyObject *kwargs) {
+    return environ_call_dict(self, "update", args, kwargs);
+}
+
+#if PY_VERSION_HEX >= 0x03090000
+static PyObject *environ_or(PyObject *a, PyObject *b) {
+    if(environ_Check(a) && environ_materialize((EnvironObject*)a) < 0)
+        return NULL;
+    if(environ_Check(b) && environ_materialize((EnvironObject*)b) < 0)
+        return NULL;
+    return PyDict_Type.tp_as_number->nb_or(a, b);
+}
+
+static PyObject *environ_ior(PyObject *self, PyObject *other) {
+    if(environ_materialize((EnvironObject*)self) < 0)
+        return NULL;
+    return PyDict_Type.tp_as_number->nb_inplace_or(self, other);
+}
+#endif
+
+static int environ_traverse(PyObject *self, visitproc visit, void *arg) {
+#if PY_VERSION_HEX >= 0x03090000
+    Py_VISIT(Py_TYPE(self));
+#endif
+    Py_VISIT(((EnvironObject*)self)->raw);
+    return PyDict_Type.tp_traverse(self, visit, arg);
+}
+
+static void environ_dealloc(PyObject *self) {
+    EnvironObject *env = (EnvironObject*)self;
+    PyTypeObject *type = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    PyMem_Free(env->pending);
+    env->pending = NULL;
+    Py_CLEAR(env->raw);
+    PyDict_Type.tp_dealloc(self);
+    Py_DECREF(type);
+}
+
+static PyMethodDef EnvironMethods[] = {
+    {"get", environ_get, METH_VARARGS, "get"},
+    {"keys", environ_dict_keys, METH_VARARGS, "keys"},
+    {"items", environ_dict_items, METH_VARARGS, "items"},
+    {"values", environ_dict_values, METH_VARARGS, "values"},
+    {"copy", environ_dict_copy, METH_VARARGS, "copy"},
+    {"pop", environ_dict_pop, METH_VARARGS, "pop"},
+    {"popitem", environ_dict_popitem, METH_VARARGS, "popitem"},
+    {"setdefault", environ_dict_setdefault, METH_VARARGS, "setdefault"},
+    /* keyword methods only fit ml_meth through a generic function pointer */
+    {"update", (PyCFunction)(void (*)(void))environ_dict_update,
+     METH_VARARGS | METH_KEYWORDS, "update"},
+    {"clear", environ_dict_clear, METH_VARARGS, "clear"},
+    {"__reversed__", environ_dict___reversed__, METH_VARARGS, ""},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyType_Slot EnvironSlots[] = {
+    {Py_tp_dealloc, (void *)environ_dealloc},
+    {Py_tp_repr, (void *)environ_repr},
+#if PY_VERSION_HEX >= 0x03090000
+    {Py_nb_or, (void *)environ_or},
+    {Py_nb_inplace_or, (void *)environ_ior},
+#endif
+    {Py_sq_contains, (void *)environ_contains},
+    {Py_mp_length, (void *)environ_length},
+    {Py_mp_subscript, (void *)environ_subscript},
+    {Py_mp_ass_subscript, (void *)environ_ass_subscript},
+    {Py_tp_doc, "lazily decoded WSGI environ"},
+    {Py_tp_traverse, (void *)environ_traverse},
+    {Py_tp_richcompare, (void *)environ_richcompare},
+    {Py_tp_iter, (void *)environ_iter},
+    {Py_tp_methods, EnvironMethods},
+    {0, NULL}
+};
+
+static PyType_Spec EnvironSpec = {
+    "_scgi_pie.Environ",       /*name*/
+    sizeof(EnvironObject),     /*basicsize*/
+    0,                         /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /*flags*/
+    EnvironSlots,              /*slots*/
+};
+
+static PyObject *environ_new_lazy(RequestObject *req) {
+    EnvironObject *env;
+    ScgiHeaders *headers = &req->req.headers;
+
+    env = (EnvironObject*)PyObject_CallObject((PyObject*)req->state->environ_type, NULL);
+    if(env == NULL)
+        return NULL;
+
+    if(PyDict_Update((PyObject*)env, req->loop_state.environ_template) < 0)
+        goto error;
+
+    env->raw = PyBytes_FromStringAndSize(headers->block, headers->block_size);
+    if(env->raw == NULL)
+        goto error;
+
+    env->pending = PyMem_Malloc(sizeof(PendingHeader) * (headers->count > 0 ? headers->count : 1));
+    if(env->pending == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    return (PyObject*)env;
+
+error:
+    Py_DECREF(env);
+    return NULL;
+}
+
+static void environ_store(PyObject *environ, PyObject *key, PyObject *value) {
+    if(environ_Check(environ))
+        environ_drop_pending((EnvironObject*)environ, key);
+    PyDict_SetItem(environ, key, value);
+}
+
+/*
+ * Everything in the environ that is the same for every request.
+ */
+static PyObject *environ_template_new(PieState *st, int multithread, int multiprocess) {
+    return Py_BuildValue("{sNsOsOsOsOssssssssss}",
+                         "wsgi.version", Py_BuildValue("(ii)", 1, 0),
+                         "wsgi.multithread", multithread ? Py_True : Py_False,
+                         "wsgi.multiprocess", multiprocess ? Py_True : Py_False,
+                         "wsgi.errors", PySys_GetObject("stderr"),
+                         "wsgi.file_wrapper", (PyObject*)st->filewrapper_type,
+                         "SCRIPT_NAME", "",
+                         "REQUEST_METHOD", "GET",
+                         "PATH_INFO", "",
+                         "QUERY_STRING", "",
+                         "SERVER_PROTOCOL", "HTTP/1.1");
+}
+
+static PyObject *setup_environ(RequestObject *req) {
+    PieState *st = req->state;
     int https = 0;
-    char *itr, *end;
-    PyObject *environ;
+    int i;
+    PyObject *environ, *template;
     PyObject *value_o;
+    EnvironObject *lazy = NULL;
     int content_length = -1;
 
-    environ = Py_BuildValue("{sNsisisisOsOsOssssssssss}",
-                            "wsgi.version", Py_BuildValue("(ii)", 1, 0),
-                            "wsgi.multithread", 1,
-                            "wsgi.multiprocess", 1,  /* who knows ? */
-                            "wsgi.run_once", req->read_fd != req->write_fd,
-                            "wsgi.errors", PySys_GetObject("stderr"),
-                            "wsgi.input", req->req.input,
-                            "wsgi.file_wrapper", (PyObject*)&FileWrapperType,
-                            "SCRIPT_NAME", "",
-                            "REQUEST_METHOD", "GET",
-                            "PATH_INFO", "",
-                            "QUERY_STRING", "",
-                            "SERVER_PROTOCOL", "HTTP/1.1");
-
-    end = headers + header_size;   /* redundant but safe */
-
-    for(itr = headers; *itr != '\0' && itr < end; ) {
-        char *name, *value;
-        int namelen, valuelen;
-
-        /* name */
-        for(name = itr, namelen = 0; itr < end && *itr; namelen++, itr++)
-            ;
-        if(++itr > end)
-            break;
+    template = req->loop_state.environ_template;
+    if(req->loop_state.lazy_environ) {
+        environ = environ_new_lazy(req);
+        if(environ == NULL)
+            return NULL;
+        lazy = (EnvironObject*)environ;
+    } else {
+        /* start from a copy of the constant entries */
+        environ = PyDict_Copy(template);
+        if(environ == NULL)
+            return NULL;
+    }
 
-        /* value */
-        for(value = itr, valuelen = 0; itr < end && *itr; valuelen++, itr++)
-            ;
-        if(++itr > end)
-            break;
+    PyDict_SetItem(environ, st->str_wsgi_run_once,
+                   req->read_fd != req->write_fd ? Py_True : Py_False);
+    PyDict_SetItem(environ, st->str_wsgi_input, (PyObject*)req->req.input);
+
+    for(i = 0; i < req->req.headers.count; i++) {
+        const ScgiHeader *h = &req->req.headers.items[i];
+        const char *value = h->value;
+        int valuelen = h->value_len;
+        EnvironKey *known;
+
+        known = environ_key_lookup(h->name, h->name_len);
+        if(lazy != NULL && (known == NULL || known->kind == ENV_PLAIN)) {
+            environ_defer(lazy, &req->req.headers, h,
+                          known != NULL ? KEY_OBJECT(st, known) : NULL);
+            continue;
+        }
 
-        if(!strncmp(name, "HTTPS", namelen)) {
+        value_o = PyUnicode_DecodeLatin1(value, valuelen, "replace");    /* XXX latin1? */
+        if(value_o == NULL)
+            continue;
+
+        if(known == NULL) {
+            environ_set(environ, h, value_o);
+            Py_DECREF(value_o);
+            continue;
+        }
+
+        switch(known->kind) {
+        case ENV_HTTPS:
             if(strncmp(value, "0", valuelen) && strncmp(value, "off", valuelen)) {
                 https = 1;
             }
-        }
-
-        value_o = PyUnicode_DecodeLatin1(value, valuelen, "replace");    /* XXX latin1? */
-        if(!strncmp(name, "HTTP_CONTENT_TYPE", namelen)) {
-            PyDict_SetItemString(environ, "CONTENT_TYPE", value_o);
-        } else if(!strncmp(name, "HTTP_CONTENT_LENGTH", namelen)) {
-            PyDict_SetItemString(environ, "CONTENT_LENGTH", value_o);
-            content_length = strntol(value, valuelen);
-        } else if(!strncmp(name, "CONTENT_LENGTH", namelen)) {
-            PyDict_SetItemString(environ, "CONTENT_LENGTH", value_o);
+            environ_store(environ, KEY_OBJECT(st, known), value_o);
+            break;
+        case ENV_CONTENT_TYPE:
+            environ_store(environ, KNOWN_KEY(st, "CONTENT_TYPE"), value_o);
+            break;
+        case ENV_CONTENT_LENGTH:
+            environ_store(environ, KNOWN_KEY(st, "CONTENT_LENGTH"), value_o);
             content_length = strntol(value, valuelen);
-        } else if(!strncmp(name, "HTTP_HOST", namelen)) {
-            PyDict_SetItemString(environ, "SERVER_NAME", value_o);
-            PyDict_SetItemString(environ, name, value_o);
-        } else {
-            PyDict_SetItemString(environ, name, value_o);
+            break;
+        case ENV_HOST:
+            environ_store(environ, KNOWN_KEY(st, "SERVER_NAME"), value_o);
+            environ_store(environ, KEY_OBJECT(st, known), value_o);
+            break;
+        default:
+            environ_store(environ, KEY_OBJECT(st, known), value_o);
+            break;
         }
 
         Py_DECREF(value_o);
     }
 
-    value_o = PyUnicode_FromString(https ? "https" : "http");
-    PyDict_SetItemString(environ, "wsgi.url_scheme", value_o);
-    Py_DECREF(value_o);
+    PyDict_SetItem(environ, st->str_wsgi_url_scheme, https ? st->str_https : st->str_http);
 
     req->req.input->size = content_length;
     req->req.input_size = content_length;
@@ -1014,9 +2458,10 @@ static void send_result(RequestObject *req, PyObject *result) {
 
     if(filewrapper_TypeCheck(result)) {
         checked_send_headers = 1;
+        req->resp.no_compress = 1;
         request_send_headers(req);
+        request_capture_stop(req);
 
-        pie_buffer_flush(&req->resp.buffer);
         if(!filewrapper_accel((FileWrapperObject*)result, req))
             return;
     }
@@ -1031,34 +2476,32 @@ static void send_result(RequestObject *req, PyObject *result) {
    
     /* Send body */
     while(!!(item = PyIter_Next(iter))) {
-        const char *bytes;
-        int byteslen;
+        Py_buffer view;
  
-        if(!PyBytes_Check(item)) {
+        if(PyObject_GetBuffer(item, &view, PyBUF_SIMPLE) < 0) {
+            PyErr_Clear();
             request_print_info(req);
             PySys_WriteStderr("Got a %s from iterator, but expected bytes.",
                     item->ob_type->tp_name);
+            request_capture_stop(req);
             Py_DECREF(item);
             break;
         }
 
-        byteslen = PyBytes_GET_SIZE(item);
-        bytes = PyBytes_AS_STRING(item);
-
-        if(byteslen > 0) {
+        if(view.len > 0) {
             if(!checked_send_headers) {
                 request_send_headers(req);
                 checked_send_headers = 1;
             }
 
-            pie_buffer_append(&req->resp.buffer, bytes, byteslen);
-            if(!req->loop_state.allow_buffering) {
-                Py_BEGIN_ALLOW_THREADS
-                pie_buffer_flush(&req->resp.buffer);
-                Py_END_ALLOW_THREADS
+            if(request_send_body(req, &view) < 0) {
+                PyBuffer_Release(&view);
+                Py_DECREF(item);
+                break;
             }
         }
 
+        PyBuffer_Release(&view);
         Py_DECREF(item);
     }
 
@@ -1066,6 +2509,7 @@ static void send_result(RequestObject *req, PyObject *result) {
         request_print_info(req);
         PySys_WriteStderr("Iterator returned an error:\n");
         PyErr_Print();
+        request_capture_stop(req);
     }
 
     Py_DECREF(iter);
@@ -1073,11 +2517,22 @@ static void send_result(RequestObject *req, PyObject *result) {
     if(!checked_send_headers)
         request_send_headers(req);
 
+    if(req->resp.compressing) {
+        request_send_compressed(req, NULL, 0, 1);
+        req->resp.compressing = 0;
+    }
+    if(req->resp.broken) {
+        request_print_info(req);
+        PySys_WriteStderr("Compressing the response failed, it was cut short\n");
+    }
+
     if(pie_buffer_size(&req->resp.buffer) > 0) {
         Py_BEGIN_ALLOW_THREADS
         pie_buffer_flush(&req->resp.buffer);
         Py_END_ALLOW_THREADS
     }
+
+    request_capture_finish(req);
 }
 
 static void close_result(RequestObject *req, PyObject *result) {
@@ -1088,7 +2543,7 @@ static void close_result(RequestObject *req, PyObject *result) {
     if(PyObject_HasAttrString(result, "close")) {
         method = PyObject_GetAttrString(result, "close");
         args = Py_BuildValue("()");
-        rv = PyEval_CallObject(method, args);
+        rv = PyObject_CallObject(method, args);
 
         if(rv == NULL) {
             request_print_info(req);
@@ -1102,35 +2557,214 @@ static void close_result(RequestObject *req, PyObject *result) {
     }
 }
 
+/*
+ * Serve the request from a static file mount, if it names one, entirely
+ * without the GIL.  Returns 0 if the application should have it instead.
+ */
+static int request_send_static(RequestObject *req, PyThreadState *py_thr) {
+    StaticFile file;
+    off_t sent = 0;
+    int rv = 0;
+    int err = 0;
+
+    if(!static_files_respond(&req->loop_state.static_files, &req->req.headers,
+                             &req->resp.buffer, &file))
+        return 0;
+
+    pie_buffer_flush(&req->resp.buffer);
+    if(file.fd < 0)
+        return 1;
+
+#ifdef __linux__
+    rv = filewrapper_linux_sendfile(file.fd, req->write_fd, 0, file.size, &sent);
+    err = errno;
+#else
+    {
+        char data[SPLICE_SIZE];
+        ssize_t got;
+
+        while(sent < file.size) {
+            got = read(file.fd, data, file.size - sent < (off_t)sizeof(data) ?
+                                      (size_t)(file.size - sent) : sizeof(data));
+            if(got <= 0) {
+                rv = got;
+                err = errno;
+                break;
+            }
+            if(pie_buffer_flush_with(&req->resp.buffer, data, got) < 0) {
+                rv = -1;
+                err = errno;
+                break;
+            }
+            sent += got;
+        }
+    }
+#endif
+    static_files_release(&req->loop_state.static_files, &file);
+
+    /* the Content-Length is already out, so all we can do is say so */
+    if(rv < 0 || sent != file.size) {
+        const ScgiHeader *path = scgi_find_header(&req->req.headers, "PATH_INFO");
+
+        PyEval_RestoreThread(py_thr);
+        request_print_info(req);
+        PySys_WriteStderr("Static file %.200s stopped after %lld of %lld bytes: %s\n",
+                          path != NULL ? path->value : "?", (long long)sent,
+                          (long long)file.size, rv < 0 ? strerror(err) : "file changed");
+        PyEval_SaveThread();
+    }
+
+    return 1;
+}
+
+/*
+ * Work out the key shared by the response cache and coalescing, or leave
+ * cache_key_len at -1 if the request can't have one.
+ */
+static void request_cache_key(RequestObject *req) {
+    if(req->req.cache_key == NULL) {
+        req->req.cache_key = malloc(RESP_CACHE_MAX_KEY);
+        if(req->req.cache_key == NULL)
+            return;
+    }
+
+    req->req.cache_key_len = resp_cache_key(&req->req.headers, &req->loop_state.cache_vary,
+                                            req->req.cache_key, RESP_CACHE_MAX_KEY);
+
+    /* responses differ by what the client can decompress */
+    if(req->req.cache_key_len >= 0 && req->loop_state.compress_level > 0) {
+        if(req->req.cache_key_len + 1 > RESP_CACHE_MAX_KEY)
+            req->req.cache_key_len = -1;
+        else
+            req->req.cache_key[req->req.cache_key_len++] = '0' + req->req.encoding;
+    }
+}
+
+/* answer from the response cache, without the GIL */
+static int request_send_cached(RequestObject *req) {
+    RespCacheEntry *entry;
+    const char *eol;
+    size_t head;
+    char age[32];
+    int age_len;
+
+    entry = resp_cache_get(&resp_cache, req->req.cache_key, req->req.cache_key_len);
+    if(entry == NULL)
+        return 0;
+
+    /* the copy is as old as the entry, so say so after the status line */
+    eol = memchr(entry->data, '\n', entry->data_len);
+    head = eol != NULL ? eol + 1 - entry->data : 0;
+    age_len = snprintf(age, sizeof(age), "Age: %d\r\n", resp_cache_age(entry));
+    pie_buffer_append(&req->resp.buffer, entry->data, head);
+    pie_buffer_append(&req->resp.buffer, age, age_len);
+    pie_buffer_flush_with(&req->resp.buffer, entry->data + head, entry->data_len - head);
+    resp_cache_release(&resp_cache, entry);
+    return 1;
+}
+
+/* credentials would make one user's page another's, unless they're in the key */
+static int request_personal(RequestObject *req) {
+    static const char *names[] = { "HTTP_COOKIE", "HTTP_AUTHORIZATION", NULL };
+    const RespCacheVary *vary = &req->loop_state.cache_vary;
+    int i, j;
+
+    for(i = 0; names[i] != NULL; i++) {
+        if(scgi_find_header(&req->req.headers, names[i]) == NULL)
+            continue;
+        for(j = 0; j < vary->count; j++) {
+            if(strcmp(vary->names[j], names[i]) == 0)
+                break;
+        }
+        if(j == vary->count)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * If an identical request is already running, wait for it (still without
+ * the GIL) and send a copy of its response.  Otherwise this request leads,
+ * and its response goes to anyone that arrives meanwhile.  Returns 0 if
+ * the application has to be called.
+ */
+static int request_coalesce(RequestObject *req) {
+    Flight *flight;
+    int leader;
+
+    if(request_personal(req))
+        return 0;
+
+    flight = flight_join(&flights, req->req.cache_key, req->req.cache_key_len, &leader);
+    if(flight == NULL)
+        return 0;
+    if(leader) {
+        req->req.flight = flight;
+        return 0;
+    }
+
+    if(flight_wait(&flights, flight, COALESCE_TIMEOUT)) {
+        pie_buffer_flush_with(&req->resp.buffer, flight->data, flight->data_len);
+        flight_leave(&flights, flight);
+        return 1;
+    }
+
+    /* the leader couldn't share or is taking too long, so do it ourselves */
+    flight_leave(&flights, flight);
+    return 0;
+}
+
 static void handle_request(RequestObject *req, PyThreadState *py_thr) {
     PyObject *start_response;
     PyObject *arglist;
     PyObject *result;
     PyObject *environ;
-    char *headers;
-    int header_size;
+    int write_fd;
 
     /* setup */
 
-    header_size = load_headers(req, &headers);
+    req->req.read_size = MIN_READ_SIZE;
+    req->resp.headers_sent = 0;
+    if(scgi_read_headers(&req->req.buffer, &req->req.headers, SCGI_MAX_HEADER_SIZE) < 0) {
+        send_error(req, req->req.headers.error);
+        return;
+    }
+
+    if(req->loop_state.static_files.count > 0 && request_send_static(req, py_thr))
+        return;
+
+    req->req.encoding = ENCODING_IDENTITY;
+    req->resp.compressing = 0;
+    req->resp.no_compress = 0;
+    req->resp.broken = 0;
+    if(req->loop_state.compress_level > 0)
+        req->req.encoding = compress_negotiate(&req->req.headers);
+
+    req->req.cache_key_len = -1;
+    req->resp.capturing = 0;
+    if(resp_cache_enabled(&resp_cache) || req->loop_state.coalesce)
+        request_cache_key(req);
+    if(req->req.cache_key_len >= 0) {
+        if(resp_cache_enabled(&resp_cache) && request_send_cached(req))
+            return;
+        if(req->loop_state.coalesce && request_coalesce(req))
+            return;
+    }
 
     PyEval_RestoreThread(py_thr);
 
-    req->req.input = (InputObject *)PyObject_New(InputObject, &InputType);
+    req->req.input = (InputObject *)PyObject_New(InputObject, req->state->input_type);
     req->req.input->buffer = &req->req.buffer;
     req->req.input->size = 0;
 
-    req->resp.headers_sent = 0;
-
-    environ = setup_environ(req, headers, header_size);
+    environ = setup_environ(req);
 
-    /* fix oddball off-by-one bug we can get from some servers */
-    if(headers[header_size-1] != ',')
-        pie_buffer_getchar(&req->req.buffer);
     /* remove byte count already sitting in buffer */
     req->req.input_size -= (int)pie_buffer_size(&req->req.buffer);
     req->req.reading_input = 1;
 
+    request_cork(req);
+
     /* perform call */
 
     start_response = PyObject_GetAttrString((PyObject*)req, "start_response");
@@ -1154,33 +2788,59 @@ static void handle_request(RequestObject *req, PyThreadState *py_thr) {
     Py_CLEAR(req->resp.status);
     Py_CLEAR(req->resp.headers);
 
+    /* nothing to share, wake up anyone waiting so they go on their own */
+    if(req->req.flight != NULL) {
+        flight_land(&flights, req->req.flight, NULL, 0);
+        flight_leave(&flights, req->req.flight);
+        req->req.flight = NULL;
+    }
+
     req->req.input->buffer = NULL;
     Py_CLEAR(req->req.input);
 
     req->resp.headers_sent = 1;
+    write_fd = req->write_fd;
     req->read_fd = req->write_fd = -1;
 
     PyEval_ReleaseThread(py_thr);
+
+    request_uncork(req, write_fd);
 }
 
 static int req_buffer_do_read(PieBuffer *buffer, void *udata) {
     RequestObject *request = (RequestObject *)udata;
-    char tmp[4096];
+    size_t want = request->req.read_size;
     ssize_t justread;
+    char *p;
     
-    if(request->req.reading_input && request->req.input_size <= 0)
+    if(request->req.reading_input) {
+        if(request->req.input_size <= 0)
+            return -1;
+        if(want > (size_t)request->req.input_size)
+            want = request->req.input_size;
+    }
+
+    /* read straight into the buffer */
+    p = pie_buffer_reserve(buffer, want, &want);
+    if(p == NULL) {
+        if(request->req.reading_input)
+            PyErr_WarnEx(NULL, "scgi-pie: Buffer append failed, buffer size is probably too low", 0);
         return -1;
+    }
 
-    justread = read(request->read_fd, tmp, sizeof(tmp));
+    justread = read(request->read_fd, p, want);
     if(justread < 0) {
         if(errno != EINTR)
             return -1;
+        justread = 0;
     } else if(justread == 0) {
         return -1;
     } else {
-        if(pie_buffer_append(buffer, tmp, justread) < 0) {
-            PyErr_WarnEx(NULL, "scgi-pie: Buffer append failed, buffer size is probably too low", 0);
-        }
+        pie_buffer_commit(buffer, justread);
+
+        /* a full read means more is probably waiting, so ask for more */
+        if((size_t)justread == want && request->req.read_size < MAX_READ_SIZE)
+            request->req.read_size *= 2;
     }
 
     if(request->req.reading_input)
@@ -1192,24 +2852,32 @@ static int req_buffer_do_read(PieBuffer *buffer, void *udata) {
     return 0;
 }
 
-static int resp_buffer_do_write(PieBuffer *buffer, const char *buf, size_t count, void *udata) {
+static ssize_t resp_buffer_do_write(PieBuffer *buffer, struct iovec *iov, int iovcnt, void *udata) {
     RequestObject *req = (RequestObject *)udata;
     ssize_t wrote;
-    ssize_t left = count;
+    ssize_t total = 0;
 
-    while(left > 0) {
-        wrote = write(req->write_fd, buf, left);
-        if(wrote <= 0) {
+    while(iovcnt > 0) {
+        wrote = writev(req->write_fd, iov, iovcnt);
+        if(wrote < 0) {
             if(errno == EINTR)
-                wrote = 0;
-            else
-                return wrote;
+                continue;
+            return wrote;
         }
+        total += wrote;
 
-        left -= wrote;
-        buf += wrote;
+        /* skip past whatever was fully written, and trim a partial write */
+        while(iovcnt > 0 && (size_t)wrote >= iov->iov_len) {
+            wrote -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + wrote;
+            iov->iov_len -= wrote;
+        }
     }
-    return count;
+    return total;
 }
 
 /*
@@ -1279,13 +2947,459 @@ static PyObject* m_load_app_from_file(PyObject *self, PyObject *args) {
     return load_app(path);
 }
 
+/*
+ * Frontend Object
+ */
+
+static int frontend_init_obj(PyObject *self, PyObject *args, PyObject *kwds) {
+    FrontendObject *fo = (FrontendObject *)self;
+    static char *kwlist[] = {"listen_socket", "buffer_size", "body_size", "queue_size", NULL};
+    int listen_fd;
+    Py_ssize_t buffer_size = 32768;
+    Py_ssize_t body_size = DEFAULT_FRONTEND_BODY;
+    Py_ssize_t queue_size = DEFAULT_FRONTEND_QUEUE;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "i|nnn", kwlist,
+                                    &listen_fd, &buffer_size, &body_size, &queue_size))
+        return -1;
+
+    if(fo->ready) {
+        PyErr_SetString(PyExc_RuntimeError, "frontend already initialized");
+        return -1;
+    }
+
+    /* everything read ahead has to fit in a worker's request buffer */
+    if(buffer_size < 1024)
+        buffer_size = 1024;
+    if(body_size < 0)
+        body_size = 0;
+    if(queue_size < 1)
+        queue_size = 1;
+
+    fo->ready = 1;
+    if(frontend_init(&fo->fe, listen_fd, buffer_size, body_size, queue_size) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void frontend_dealloc(PyObject *self) {
+    FrontendObject *fo = (FrontendObject *)self;
+    PyTypeObject *type = Py_TYPE(self);
+
+    if(fo->ready)
+        frontend_free(&fo->fe);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyObject *frontend_run_loop(PyObject *self, PyObject *args) {
+    FrontendObject *fo = (FrontendObject *)self;
+    PyThreadState *py_thr;
+    int result;
+
+    if(!fo->ready || fo->running) {
+        PyErr_SetString(PyExc_RuntimeError, "frontend not ready or already running");
+        return NULL;
+    }
+
+    fo->running = 1;
+    py_thr = PyEval_SaveThread();
+    result = frontend_run(&fo->fe);
+    PyEval_RestoreThread(py_thr);
+    fo->running = 0;
+
+    if(result < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *frontend_halt_loop(PyObject *self, PyObject *args) {
+    FrontendObject *fo = (FrontendObject *)self;
+
+    if(fo->ready)
+        frontend_halt(&fo->fe);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* queue counters, times in seconds */
+static PyObject *frontend_stats(PyObject *self, PyObject *args) {
+    FrontendObject *fo = (FrontendObject *)self;
+    FrontendStats st;
+
+    if(!fo->ready) {
+        PyErr_SetString(PyExc_RuntimeError, "frontend not ready");
+        return NULL;
+    }
+    frontend_get_stats(&fo->fe, &st);
+
+    return Py_BuildValue("{sKsKsKsnsnsisdsd}",
+                         "queued", st.queued,
+                         "taken", st.taken,
+                         "full", st.full,
+                         "depth", (Py_ssize_t)st.depth,
+                         "max_depth", (Py_ssize_t)st.max_depth,
+                         "overflow", st.overflow,
+                         "wait_total", st.wait_total / 1e6,
+                         "wait_max", st.wait_max / 1e6);
+}
+
+static PyMethodDef FrontendMethods[] = {
+    {"run", (PyCFunction)frontend_run_loop, METH_NOARGS, ""},
+    {"halt", (PyCFunction)frontend_halt_loop, METH_NOARGS, ""},
+    {"stats", (PyCFunction)frontend_stats, METH_NOARGS, ""},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyType_Slot FrontendSlots[] = {
+    {Py_tp_dealloc, (void *)frontend_dealloc},
+    {Py_tp_doc, "Frontend Object"},
+    {Py_tp_methods, FrontendMethods},
+    {Py_tp_init, (void *)frontend_init_obj},
+    {Py_tp_new, (void *)PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec FrontendSpec = {
+    "_scgi_pie.Frontend",      /*name*/
+    sizeof(FrontendObject),    /*basicsize*/
+    0,                         /*itemsize*/
+    Py_TPFLAGS_DEFAULT,        /*flags*/
+    FrontendSlots,             /*slots*/
+};
+
+static int frontend_TypeCheck(PyObject *self) {
+    return Py_TYPE(self)->tp_dealloc == frontend_dealloc;
+}
+
+/*
+ * Worker Pool Object
+ */
+
+static int worker_pool_init_obj(PyObject *self, PyObject *args, PyObject *kwds) {
+    WorkerPoolObject *wo = (WorkerPoolObject *)self;
+    static char *kwlist[] = {"listen_sockets", "min_threads", "max_threads", "idle_timeout", NULL};
+    PyObject *sockets, *seq;
+    int min_threads, max_threads;
+    int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    int *fds;
+    Py_ssize_t i, n;
+    int result;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "Oii|i", kwlist,
+                                    &sockets, &min_threads, &max_threads, &idle_timeout))
+        return -1;
+
+    if(wo->ready) {
+        PyErr_SetString(PyExc_RuntimeError, "worker pool already initialized");
+        return -1;
+    }
+
+    seq = PySequence_Fast(sockets, "listen_sockets must be a sequence");
+    if(seq == NULL)
+        return -1;
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    fds = PyMem_Malloc(sizeof(int) * (n > 0 ? n : 1));
+    if(fds == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for(i = 0; i < n; i++) {
+        fds[i] = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+        if(fds[i] == -1 && PyErr_Occurred()) {
+            PyMem_Free(fds);
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+    Py_DECREF(seq);
+
+    result = worker_pool_init(&wo->pool, fds, (int)n, min_threads, max_threads, idle_timeout);
+    PyMem_Free(fds);
+    if(result < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    wo->ready = 1;
+
+    return 0;
+}
+
+static void worker_pool_dealloc(PyObject *self) {
+    WorkerPoolObject *wo = (WorkerPoolObject *)self;
+    PyTypeObject *type = Py_TYPE(self);
+
+    if(wo->ready)
+        worker_pool_free(&wo->pool);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static WorkerPool *worker_pool_get(PyObject *self) {
+    WorkerPoolObject *wo = (WorkerPoolObject *)self;
+
+    if(!wo->ready) {
+        PyErr_SetString(PyExc_RuntimeError, "worker pool not ready");
+        return NULL;
+    }
+    return &wo->pool;
+}
+
+static PyObject *worker_pool_reserve_obj(PyObject *self, PyObject *args) {
+    WorkerPool *pool = worker_pool_get(self);
+
+    if(pool == NULL)
+        return NULL;
+    return PyBool_FromLong(worker_pool_reserve(pool));
+}
+
+/* True to start another thread, False on timeout, None once halted */
+static PyObject *worker_pool_wait_obj(PyObject *self, PyObject *args) {
+    WorkerPool *pool = worker_pool_get(self);
+    PyThreadState *py_thr;
+    int timeout_ms;
+    int result;
+
+    if(pool == NULL || !PyArg_ParseTuple(args, "i", &timeout_ms))
+        return NULL;
+
+    py_thr = PyEval_SaveThread();
+    result = worker_pool_wait(pool, timeout_ms);
+    PyEval_RestoreThread(py_thr);
+
+    if(result < 0) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return PyBool_FromLong(result);
+}
+
+static PyObject *worker_pool_halt_obj(PyObject *self, PyObject *args) {
+    WorkerPool *pool = worker_pool_get(self);
+
+    if(pool == NULL)
+        return NULL;
+    worker_pool_halt(pool);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *worker_pool_stats(PyObject *self, PyObject *args) {
+    WorkerPool *pool = worker_pool_get(self);
+    WorkerPoolStats st;
+
+    if(pool == NULL)
+        return NULL;
+    worker_pool_get_stats(pool, &st);
+
+    return Py_BuildValue("{sisisisKsK}",
+                         "threads", st.threads,
+                         "busy", st.busy,
+                         "peak", st.peak,
+                         "spawned", st.spawned,
+                         "retired", st.retired);
+}
+
+static PyMethodDef WorkerPoolMethods[] = {
+    {"reserve", (PyCFunction)worker_pool_reserve_obj, METH_NOARGS, ""},
+    {"wait", (PyCFunction)worker_pool_wait_obj, METH_VARARGS, ""},
+    {"halt", (PyCFunction)worker_pool_halt_obj, METH_NOARGS, ""},
+    {"stats", (PyCFunction)worker_pool_stats, METH_NOARGS, ""},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyType_Slot WorkerPoolSlots[] = {
+    {Py_tp_dealloc, (void *)worker_pool_dealloc},
+    {Py_tp_doc, "Worker Pool Object"},
+    {Py_tp_methods, WorkerPoolMethods},
+    {Py_tp_init, (void *)worker_pool_init_obj},
+    {Py_tp_new, (void *)PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec WorkerPoolSpec = {
+    "_scgi_pie.WorkerPool",    /*name*/
+    sizeof(WorkerPoolObject),  /*basicsize*/
+    0,                         /*itemsize*/
+    Py_TPFLAGS_DEFAULT,        /*flags*/
+    WorkerPoolSlots,           /*slots*/
+};
+
+static int worker_pool_TypeCheck(PyObject *self) {
+    return Py_TYPE(self)->tp_dealloc == worker_pool_dealloc;
+}
+
+/*
+ * Subinterpreter Object
+ */
+
+/* halt flag of the subinterpreter running on this thread, if any */
+static __thread volatile int *current_halt;
+
+#if PY_VERSION_HEX >= 0x030C0000
+typedef struct {
+    PyObject_HEAD
+
+    volatile int quitting;
+    int running;
+    pthread_t thread;
+} SubinterpreterObject;
+
+/*
+ * Runs script in a new interpreter with its own GIL on this thread,
+ * until it returns.  Only ints and strings can cross over, so the
+ * script has to load the application itself.
+ */
+static PyObject *subinterpreter_run(PyObject *self, PyObject *args) {
+    SubinterpreterObject *so = (SubinterpreterObject *)self;
+    PyInterpreterConfig config = {
+        .use_main_obmalloc = 0,
+        .allow_fork = 0,
+        .allow_exec = 0,
+        .allow_threads = 1,
+        .allow_daemon_threads = 0,
+        .check_multi_interp_extensions = 1,
+        .gil = PyInterpreterConfig_OWN_GIL,
+    };
+    PyThreadState *main_thr, *sub_thr = NULL;
+    PyStatus status;
+    const char *script;
+    char *copy;
+    int rc;
+
+    if(!PyArg_ParseTuple(args, "s", &script))
+        return NULL;
+
+    if(so->running) {
+        PyErr_SetString(PyExc_RuntimeError, "subinterpreter already running");
+        return NULL;
+    }
+
+    /* the argument belongs to this interpreter, which is about to let go */
+    copy = strdup(script);
+    if(copy == NULL)
+        return PyErr_NoMemory();
+
+    so->thread = pthread_self();
+    so->running = 1;
+    current_halt = &so->quitting;
+
+    main_thr = PyThreadState_Get();
+    status = Py_NewInterpreterFromConfig(&sub_thr, &config);
+    if(PyStatus_Exception(status)) {
+        PyThreadState_Swap(main_thr);
+        current_halt = NULL;
+        so->running = 0;
+        free(copy);
+        PyErr_SetString(PyExc_RuntimeError,
+                        status.err_msg ? status.err_msg : "couldn't create subinterpreter");
+        return NULL;
+    }
+
+    rc = so->quitting ? 0 : PyRun_SimpleString(copy);
+
+    Py_EndInterpreter(sub_thr);
+    PyEval_RestoreThread(main_thr);
+
+    current_halt = NULL;
+    so->running = 0;
+    free(copy);
+
+    if(rc < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "subinterpreter worker failed");
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *subinterpreter_halt(PyObject *self, PyObject *args) {
+    SubinterpreterObject *so = (SubinterpreterObject *)self;
+
+    /* the thread can't go away while we hold this interpreter's GIL */
+    so->quitting = 1;
+    if(so->running && pthread_kill(so->thread, SIGINT) != 0)
+        perror("pthread_kill");
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static void subinterpreter_dealloc(PyObject *self) {
+    PyTypeObject *type = Py_TYPE(self);
+
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyMethodDef SubinterpreterMethods[] = {
+    {"run", (PyCFunction)subinterpreter_run, METH_VARARGS, ""},
+    {"halt", (PyCFunction)subinterpreter_halt, METH_NOARGS, ""},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyType_Slot SubinterpreterSlots[] = {
+    {Py_tp_dealloc, (void *)subinterpreter_dealloc},
+    {Py_tp_doc, "Subinterpreter Object"},
+    {Py_tp_methods, SubinterpreterMethods},
+    {Py_tp_new, (void *)PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec SubinterpreterSpec = {
+    "_scgi_pie.Subinterpreter",    /*name*/
+    sizeof(SubinterpreterObject),  /*basicsize*/
+    0,                             /*itemsize*/
+    Py_TPFLAGS_DEFAULT,            /*flags*/
+    SubinterpreterSlots,           /*slots*/
+};
+#endif
+
 /*
  * Main Loop
  */
 
+static int request_quitting(RequestObject *req) {
+    return req->loop_state.quitting ||
+           (req->loop_state.halted != NULL && *req->loop_state.halted);
+}
+
+/* next connection read by the frontend, with what it read already buffered */
+static int request_take_ready(RequestObject *req) {
+    FrontendConn *conn;
+    int fd;
+
+    conn = frontend_next(&req->loop_state.frontend->fe, &req->loop_state.quitting);
+    if(conn == NULL) {
+        errno = EINTR;
+        return -1;
+    }
+
+    fd = conn->fd;
+    if(pie_buffer_append(&req->req.buffer, conn->data, conn->len) < 0) {
+        close(fd);
+        fd = -1;
+        errno = EINTR;
+    }
+    frontend_conn_free(conn);
+
+    return fd;
+}
+
 static PyObject *request_accept_loop(PyObject *self, PyObject *args) {
     RequestObject *request;
     PyThreadState *py_thr;
+    WorkerPool *pool = NULL;
 
     if(!request_TypeCheck(self)) {
         PyErr_SetString(PyExc_TypeError, "expected request object");
@@ -1295,24 +3409,44 @@ static PyObject *request_accept_loop(PyObject *self, PyObject *args) {
 
     request->loop_state.in_accept = 1;
     request->loop_state.thread_id = PyThreadState_Get()->thread_id;
+    request->loop_state.halted = current_halt;
+    if(request->loop_state.worker_pool != NULL)
+        pool = &request->loop_state.worker_pool->pool;
 
     py_thr = PyEval_SaveThread();
 
-    while(!request->loop_state.quitting) {
-        int fd = accept(request->loop_state.listen_fd, NULL, NULL);
+    while(!request_quitting(request)) {
+        int fd;
+
+        if(request->loop_state.frontend != NULL)
+            fd = request_take_ready(request);
+        else
+            fd = accept(request->loop_state.listen_fd, NULL, NULL);
         if(fd >= 0) {
+            if(pool != NULL)
+                worker_pool_busy(pool, fd);
             request->read_fd = request->write_fd = fd;
             request->req.reading_input = 0;
             handle_request(request, py_thr);
             request->read_fd = request->write_fd = -1;
             close(fd);
+            if(pool != NULL)
+                worker_pool_idle(pool);
+        } else if(pool != NULL && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* the worker pool's idle timeout on the listen socket */
+            if(worker_pool_retire(pool))
+                break;
         } else if(errno != EMFILE && errno != ENFILE && errno != EINTR) {
+            if(pool != NULL)
+                worker_pool_leave(pool);
             PyEval_RestoreThread(py_thr);
+            request->loop_state.in_accept = 0;
             return PyErr_SetFromErrno(PyExc_OSError);
         }
 
         pie_buffer_restart(&request->req.buffer);
         pie_buffer_restart(&request->resp.buffer);
+        pie_buffer_pool_trim(&request->pool);
     }
 
     PyEval_RestoreThread(py_thr);
@@ -1337,6 +3471,8 @@ static PyObject *request_halt_loop(PyObject *self, PyObject *args) {
     }
 
     req->loop_state.listen_fd = -1;
+    if(req->loop_state.frontend != NULL)
+        frontend_wake(&req->loop_state.frontend->fe);
     
     if(pthread_kill((pthread_t)req->loop_state.thread_id, SIGINT) < 0)
         perror("pthread_kill");
@@ -1379,21 +3515,164 @@ static PyObject *request_run_once(PyObject *self, PyObject *args) {
  * Module
  */ 
 
+/*
+ * Give free heap memory back to the system, so forked children don't
+ * start out sharing pages that are only holes.  Returns whether any was.
+ */
+static PyObject* m_malloc_trim(PyObject *self, PyObject *args) {
+#ifdef __GLIBC__
+    return PyBool_FromLong(malloc_trim(0));
+#else
+    return PyBool_FromLong(0);
+#endif
+}
+
 static PyMethodDef ModuleMethods[] = {
     {"load_app_from_file", (PyCFunction)m_load_app_from_file, METH_VARARGS, ""},
+    {"malloc_trim", (PyCFunction)m_malloc_trim, METH_NOARGS, ""},
     {NULL, NULL, 0, NULL}
 };
 
+static PyTypeObject *module_add_type(PyObject *m, PyType_Spec *spec, PyObject *bases,
+                                     const char *name) {
+    PyObject *type;
+
+#if PY_VERSION_HEX >= 0x03090000
+    type = PyType_FromModuleAndSpec(m, spec, bases);
+#else
+    type = PyType_FromSpecWithBases(spec, bases);
+#endif
+    if(type == NULL)
+        return NULL;
+
+    if(name != NULL) {
+        Py_INCREF(type);
+        if(PyModule_AddObject(m, name, type) < 0) {
+            Py_DECREF(type);
+            Py_DECREF(type);
+            return NULL;
+        }
+    }
+
+    return (PyTypeObject *)type;
+}
+
+static int module_exec(PyObject *m) {
+    PieState *st = (PieState *)PyModule_GetState(m);
+    PyObject *dict_bases;
+
+#if PY_VERSION_HEX < 0x03090000
+    legacy_state = st;
+#endif
+
+    if(environ_keys_init(st) < 0)
+        return -1;
+
+    st->request_type = module_add_type(m, &RequestSpec, NULL, "Request");
+    if(st->request_type == NULL)
+        return -1;
+
+    st->input_type = module_add_type(m, &InputSpec, NULL, NULL);
+    if(st->input_type == NULL)
+        return -1;
+
+    st->filewrapper_type = module_add_type(m, &FileWrapperSpec, NULL, NULL);
+    if(st->filewrapper_type == NULL)
+        return -1;
+
+    st->frontend_type = module_add_type(m, &FrontendSpec, NULL, "Frontend");
+    if(st->frontend_type == NULL)
+        return -1;
+
+    st->worker_pool_type = module_add_type(m, &WorkerPoolSpec, NULL, "WorkerPool");
+    if(st->worker_pool_type == NULL)
+        return -1;
+
+    dict_bases = PyTuple_Pack(1, (PyObject *)&PyDict_Type);
+    if(dict_bases == NULL)
+        return -1;
+    st->environ_type = module_add_type(m, &EnvironSpec, dict_bases, NULL);
+    Py_DECREF(dict_bases);
+    if(st->environ_type == NULL)
+        return -1;
+
+#if PY_VERSION_HEX >= 0x030C0000
+    st->subinterpreter_type = module_add_type(m, &SubinterpreterSpec, NULL, "Subinterpreter");
+    if(st->subinterpreter_type == NULL)
+        return -1;
+#endif
+
+    return 0;
+}
+
+static int module_traverse(PyObject *m, visitproc visit, void *arg) {
+    PieState *st = (PieState *)PyModule_GetState(m);
+
+    if(st == NULL)
+        return 0;
+
+    Py_VISIT(st->request_type);
+    Py_VISIT(st->input_type);
+    Py_VISIT(st->filewrapper_type);
+    Py_VISIT(st->environ_type);
+    Py_VISIT(st->frontend_type);
+    Py_VISIT(st->worker_pool_type);
+#if PY_VERSION_HEX >= 0x030C0000
+    Py_VISIT(st->subinterpreter_type);
+#endif
+    return 0;
+}
+
+static int module_clear(PyObject *m) {
+    PieState *st = (PieState *)PyModule_GetState(m);
+    int i;
+
+    if(st == NULL)
+        return 0;
+
+    Py_CLEAR(st->request_type);
+    Py_CLEAR(st->input_type);
+    Py_CLEAR(st->filewrapper_type);
+    Py_CLEAR(st->environ_type);
+    Py_CLEAR(st->frontend_type);
+    Py_CLEAR(st->worker_pool_type);
+#if PY_VERSION_HEX >= 0x030C0000
+    Py_CLEAR(st->subinterpreter_type);
+#endif
+
+    Py_CLEAR(st->str_wsgi_input);
+    Py_CLEAR(st->str_wsgi_run_once);
+    Py_CLEAR(st->str_wsgi_url_scheme);
+    Py_CLEAR(st->str_http);
+    Py_CLEAR(st->str_https);
+    for(i = 0; i < ENVIRON_KEYS_SIZE; i++)
+        Py_CLEAR(st->environ_keys[i]);
+    return 0;
+}
+
+static void module_free(void *m) {
+    module_clear((PyObject *)m);
+}
+
+static PyModuleDef_Slot ModuleSlots[] = {
+    {Py_mod_exec, (void *)module_exec},
+#ifdef Py_MOD_PER_INTERPRETER_GIL_SUPPORTED
+    /* all shared state is plain C behind its own locks */
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+    {0, NULL}
+};
+
 static struct PyModuleDef ModuleDef = {
-    {}, /* m_base */
+    PyModuleDef_HEAD_INIT, /* m_base */
     "scgi_pie",  /* m_name */
     0,  /* m_doc */
-    0,  /* m_size */
+    sizeof(PieState),  /* m_size */
     ModuleMethods,  /* m_methods */
-    0,  /* m_reload */
-    0,  /* m_traverse */
-    0,  /* m_clear */
-    0,  /* m_free */
+    ModuleSlots,  /* m_slots */
+    module_traverse,  /* m_traverse */
+    module_clear,  /* m_clear */
+    module_free,  /* m_free */
 };
 
 #if !defined _WIN32 && defined __GNUC__
@@ -1401,22 +3680,5 @@ __attribute__((visibility("default")))
 #endif
 PyMODINIT_FUNC
 PyInit__scgi_pie(void) {
-    PyObject *m;
-
-    if(PyType_Ready(&RequestType) < 0)
-        return NULL;
-
-    if(PyType_Ready(&InputType) < 0)
-        return NULL;
-
-    if (PyType_Ready(&FileWrapperType) < 0)
-        return NULL;
-
-    m = PyModule_Create(&ModuleDef);
-    if (m == NULL)
-        return NULL;
-
-    PyModule_AddObject(m, "Request", (PyObject *)&RequestType);
-
-    return m;
+    return PyModuleDef_Init(&ModuleDef);
 }
@@ -0,0 +1,492 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "respcache.h"
+
+#define BUCKETS         (1024)
+#define MAX_ENTRY_SHARE (8)     /* no single response over budget/8 */
+
+static long long now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long hash_key(const char *key, size_t len) {
+    unsigned long h = 2166136261UL;
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static size_t entry_cost(RespCacheEntry *e) {
+    return sizeof(RespCacheEntry) + e->key_len + e->data_len;
+}
+
+static void entry_free(RespCacheEntry *e) {
+    free(e->key);
+    free(e->data);
+    free(e);
+}
+
+/*
+ * Table and LRU list, all with the lock held
+ */
+
+static RespCacheEntry *lookup(RespCache *cache, unsigned long hash,
+                              const char *key, size_t key_len) {
+    RespCacheEntry *e;
+
+    if(cache->buckets == NULL)
+        return NULL;
+
+    for(e = cache->buckets[hash & (cache->nbuckets - 1)]; e != NULL; e = e->hnext) {
+        if(e->hash == hash && e->key_len == key_len && memcmp(e->key, key, key_len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void lru_unlink(RespCache *cache, RespCacheEntry *e) {
+    if(e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+    if(e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(RespCache *cache, RespCacheEntry *e) {
+    e->prev = NULL;
+    e->next = cache->head;
+    if(cache->head)
+        cache->head->prev = e;
+    else
+        cache->tail = e;
+    cache->head = e;
+}
+
+/* take out of the table, and free unless someone is still sending it */
+static void drop(RespCache *cache, RespCacheEntry *e) {
+    RespCacheEntry **itr = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+
+    while(*itr != e)
+        itr = &(*itr)->hnext;
+    *itr = e->hnext;
+
+    lru_unlink(cache, e);
+    cache->bytes -= entry_cost(e);
+    e->stale = 1;
+    if(e->refs == 0)
+        entry_free(e);
+}
+
+static void evict(RespCache *cache, size_t want) {
+    while(cache->tail != NULL && cache->bytes + want > cache->budget)
+        drop(cache, cache->tail);
+}
+
+/*
+ * Public
+ */
+
+int resp_cache_configure(RespCache *cache, size_t budget) {
+    int rv = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    if(cache->buckets == NULL && budget > 0) {
+        cache->buckets = calloc(BUCKETS, sizeof(RespCacheEntry *));
+        if(cache->buckets == NULL) {
+            errno = ENOMEM;
+            rv = -1;
+            budget = 0;
+        } else
+            cache->nbuckets = BUCKETS;
+    }
+
+    cache->budget = budget;
+    evict(cache, 0);
+    pthread_mutex_unlock(&cache->lock);
+
+    return rv;
+}
+
+int resp_cache_enabled(RespCache *cache) {
+    int enabled;
+
+    pthread_mutex_lock(&cache->lock);
+    enabled = cache->budget > 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    return enabled;
+}
+
+size_t resp_cache_max_entry(RespCache *cache) {
+    size_t max;
+
+    pthread_mutex_lock(&cache->lock);
+    max = cache->budget / MAX_ENTRY_SHARE;
+    pthread_mutex_unlock(&cache->lock);
+
+    return max;
+}
+
+RespCacheEntry *resp_cache_get(RespCache *cache, const char *key, size_t key_len) {
+    unsigned long hash = hash_key(key, key_len);
+    RespCacheEntry *e;
+
+    pthread_mutex_lock(&cache->lock);
+    e = lookup(cache, hash, key, key_len);
+    if(e != NULL) {
+        if(e->expires <= now_usec()) {
+            drop(cache, e);
+            e = NULL;
+        } else {
+            e->refs++;
+            lru_unlink(cache, e);
+            lru_push(cache, e);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return e;
+}
+
+int resp_cache_age(RespCacheEntry *entry) {
+    return (now_usec() - entry->stored) / 1000000;
+}
+
+void resp_cache_release(RespCache *cache, RespCacheEntry *entry) {
+    int dead;
+
+    pthread_mutex_lock(&cache->lock);
+    entry->refs--;
+    dead = entry->stale && entry->refs == 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    if(dead)
+        entry_free(entry);
+}
+
+int resp_cache_put(RespCache *cache, const char *key, size_t key_len,
+                   char *data, size_t data_len, int ttl) {
+    RespCacheEntry *e, *old;
+
+    e = malloc(sizeof(RespCacheEntry));
+    if(e == NULL || (e->key = malloc(key_len)) == NULL) {
+        free(e);
+        free(data);
+        return -1;
+    }
+    memcpy(e->key, key, key_len);
+    e->key_len = key_len;
+    e->data = data;
+    e->data_len = data_len;
+    e->hash = hash_key(key, key_len);
+    e->stored = now_usec();
+    e->expires = e->stored + (long long)ttl * 1000000;
+    e->refs = 0;
+    e->stale = 0;
+    e->hnext = e->prev = e->next = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if(cache->buckets == NULL || entry_cost(e) > cache->budget / MAX_ENTRY_SHARE) {
+        pthread_mutex_unlock(&cache->lock);
+        entry_free(e);
+        return -1;
+    }
+
+    old = lookup(cache, e->hash, key, key_len);
+    if(old != NULL)
+        drop(cache, old);
+    evict(cache, entry_cost(e));
+
+    e->hnext = cache->buckets[e->hash & (cache->nbuckets - 1)];
+    cache->buckets[e->hash & (cache->nbuckets - 1)] = e;
+    lru_push(cache, e);
+    cache->bytes += entry_cost(e);
+    pthread_mutex_unlock(&cache->lock);
+
+    return 0;
+}
+
+/*
+ * Keys
+ */
+
+static int key_append(char *key, size_t size, size_t *len, const char *data, size_t n) {
+    if(*len + n + 1 > size)
+        return -1;
+    memcpy(key + *len, data, n);
+    *len += n;
+    key[(*len)++] = '\0';
+    return 0;
+}
+
+/* the same way wsgi.url_scheme is worked out */
+static const char *key_scheme(const ScgiHeaders *headers) {
+    const ScgiHeader *https = scgi_find_header(headers, "HTTPS");
+
+    if(https != NULL && https->value_len > 0 &&
+       strcmp(https->value, "0") != 0 && strcmp(https->value, "off") != 0)
+        return "https";
+    return "http";
+}
+
+/* the virtual host, from Host or else the server's own name and port */
+static int key_host(const ScgiHeaders *headers, char *key, size_t size, size_t *len) {
+    const ScgiHeader *host, *name, *port;
+
+    host = scgi_find_header(headers, "HTTP_HOST");
+    if(host != NULL)
+        return key_append(key, size, len, host->value, host->value_len);
+
+    name = scgi_find_header(headers, "SERVER_NAME");
+    port = scgi_find_header(headers, "SERVER_PORT");
+    if(*len + 1 > size)
+        return -1;
+    key[(*len)++] = '\1';
+    if(key_append(key, size, len, name ? name->value : "", name ? name->value_len : 0) < 0)
+        return -1;
+    return key_append(key, size, len, port ? port->value : "", port ? port->value_len : 0);
+}
+
+ssize_t resp_cache_key(const ScgiHeaders *headers, const RespCacheVary *vary,
+                       char *key, size_t size) {
+    const ScgiHeader *method, *script, *info, *query, *h;
+    const char *scheme;
+    size_t len = 0;
+    int i;
+
+    method = scgi_find_header(headers, "REQUEST_METHOD");
+    if(method == NULL ||
+       (strcmp(method->value, "GET") != 0 && strcmp(method->value, "HEAD") != 0))
+        return -1;
+
+    if(key_append(key, size, &len, method->value, method->value_len) < 0)
+        return -1;
+    scheme = key_scheme(headers);
+    if(key_append(key, size, &len, scheme, strlen(scheme)) < 0)
+        return -1;
+    if(key_host(headers, key, size, &len) < 0)
+        return -1;
+
+    script = scgi_find_header(headers, "SCRIPT_NAME");
+    info = scgi_find_header(headers, "PATH_INFO");
+    query = scgi_find_header(headers, "QUERY_STRING");
+
+    if(key_append(key, size, &len, script ? script->value : "", script ? script->value_len : 0) < 0)
+        return -1;
+    if(key_append(key, size, &len, info ? info->value : "", info ? info->value_len : 0) < 0)
+        return -1;
+    if(key_append(key, size, &len, query ? query->value : "", query ? query->value_len : 0) < 0)
+        return -1;
+
+    /* a missing header is kept apart from an empty one */
+    for(i = 0; i < vary->count; i++) {
+        h = scgi_find_header(headers, vary->names[i]);
+        if(h != NULL) {
+            if(key_append(key, size, &len, h->value, h->value_len) < 0)
+                return -1;
+        } else if(key_append(key, size, &len, "\1", 1) < 0)
+            return -1;
+    }
+
+    return len;
+}
+
+/*
+ * Response Headers
+ */
+
+static int token_is(const char *tok, size_t len, const char *name) {
+    return strlen(name) == len && strncasecmp(tok, name, len) == 0;
+}
+
+int resp_cache_ttl(const char *value, size_t len) {
+    const char *end = value + len;
+    const char *p = value;
+    int is_public = 0;
+    long max_age = -1, s_maxage = -1;
+
+    while(p < end) {
+        const char *tok, *eq;
+        size_t toklen;
+
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        tok = p;
+        while(p < end && *p != ',')
+            p++;
+        toklen = p - tok;
+        while(toklen > 0 && (tok[toklen-1] == ' ' || tok[toklen-1] == '\t'))
+            toklen--;
+        if(toklen == 0)
+            continue;
+
+        eq = memchr(tok, '=', toklen);
+        if(eq == NULL) {
+            if(token_is(tok, toklen, "public"))
+                is_public = 1;
+            else if(token_is(tok, toklen, "private") || token_is(tok, toklen, "no-store") ||
+                    token_is(tok, toklen, "no-cache"))
+                return -1;
+        } else {
+            const char *v = eq + 1;
+            long n = 0;
+
+            if(v < tok + toklen && *v == '"')
+                v++;
+            while(v < tok + toklen && *v >= '0' && *v <= '9' && n < 100000000)
+                n = n * 10 + (*v++ - '0');
+
+            if(token_is(tok, eq - tok, "max-age"))
+                max_age = n;
+            else if(token_is(tok, eq - tok, "s-maxage"))
+                s_maxage = n;
+            else if(token_is(tok, eq - tok, "private") || token_is(tok, eq - tok, "no-cache"))
+                return -1;
+        }
+    }
+
+    /* we're a shared cache, so s-maxage wins */
+    if(s_maxage >= 0)
+        max_age = s_maxage;
+    if(!is_public || max_age <= 0)
+        return -1;
+    return (int)max_age;
+}
+
+int resp_cache_shareable(const char *value, size_t len) {
+    const char *end = value + len;
+    const char *p = value;
+
+    while(p < end) {
+        const char *tok;
+        size_t toklen;
+
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        tok = p;
+        while(p < end && *p != ',' && *p != '=' && *p != ' ' && *p != '\t')
+            p++;
+        toklen = p - tok;
+        while(p < end && *p != ',')
+            p++;
+
+        if(token_is(tok, toklen, "private") || token_is(tok, toklen, "no-store"))
+            return 0;
+    }
+    return 1;
+}
+
+/* Accept-Encoding to HTTP_ACCEPT_ENCODING */
+static int cgi_name(const char *header, size_t len, char *out, size_t size) {
+    size_t i;
+
+    if(len + 6 > size)
+        return -1;
+    memcpy(out, "HTTP_", 5);
+    for(i = 0; i < len; i++)
+        out[5 + i] = header[i] == '-' ? '_' : toupper((unsigned char)header[i]);
+    out[5 + len] = '\0';
+    return 0;
+}
+
+int resp_cache_vary_covered(const RespCacheVary *vary, const char *value, size_t len) {
+    const char *end = value + len;
+    const char *p = value;
+    char name[256];
+
+    while(p < end) {
+        const char *tok;
+        size_t toklen;
+        int i;
+
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        tok = p;
+        while(p < end && *p != ',' && *p != ' ' && *p != '\t')
+            p++;
+        toklen = p - tok;
+        if(toklen == 0)
+            continue;
+
+        if(cgi_name(tok, toklen, name, sizeof(name)) < 0)
+            return 0;
+        for(i = 0; i < vary->count; i++) {
+            if(strcmp(vary->names[i], name) == 0)
+                break;
+        }
+        /* also catches "*" */
+        if(i == vary->count)
+            return 0;
+    }
+    return 1;
+}
+
+int resp_cache_vary_add(RespCacheVary *vary, const char *header) {
+    char name[256];
+    char **names;
+
+    if(cgi_name(header, strlen(header), name, sizeof(name)) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    names = realloc(vary->names, (vary->count + 1) * sizeof(char *));
+    if(names == NULL)
+        return -1;
+    vary->names = names;
+
+    names[vary->count] = strdup(name);
+    if(names[vary->count] == NULL)
+        return -1;
+    vary->count++;
+    return 0;
+}
+
+void resp_cache_vary_free(RespCacheVary *vary) {
+    int i;
+
+    for(i = 0; i < vary->count; i++)
+        free(vary->names[i]);
+    free(vary->names);
+    vary->names = NULL;
+    vary->count = 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PIE_RESPCACHE_H
+#define PIE_RESPCACHE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "scgi.h"
+
+#define RESP_CACHE_MAX_KEY      (8192)
+
+typedef struct RespCacheEntry RespCacheEntry;
+
+struct RespCacheEntry {
+    RespCacheEntry *hnext;      /* hash chain */
+    RespCacheEntry *prev, *next;/* lru list, most recent first */
+    unsigned long hash;
+
+    char *key;
+    size_t key_len;
+    char *data;                 /* the whole response, as sent */
+    size_t data_len;
+    long long stored;           /* usec */
+    long long expires;          /* usec */
+
+    int refs;
+    int stale;                  /* out of the table, freed on last release */
+};
+
+/*
+ * Complete responses, shared between threads, kept within a byte budget.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    RespCacheEntry **buckets;
+    size_t nbuckets;
+    RespCacheEntry *head, *tail;
+    size_t bytes;
+    size_t budget;              /* 0 when disabled */
+} RespCache;
+
+#define RESP_CACHE_INIT { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, NULL, 0, 0 }
+
+/* request headers that responses may vary on, in CGI form (HTTP_ACCEPT) */
+typedef struct {
+    char **names;
+    int count;
+} RespCacheVary;
+
+int resp_cache_configure(RespCache *cache, size_t budget);
+int resp_cache_enabled(RespCache *cache);
+size_t resp_cache_max_entry(RespCache *cache);
+
+/* returns a referenced, unexpired entry, or NULL */
+RespCacheEntry *resp_cache_get(RespCache *cache, const char *key, size_t key_len);
+void resp_cache_release(RespCache *cache, RespCacheEntry *entry);
+
+/* seconds since the entry was stored, for its Age header */
+int resp_cache_age(RespCacheEntry *entry);
+
+/* takes ownership of data, even on failure */
+int resp_cache_put(RespCache *cache, const char *key, size_t key_len,
+                   char *data, size_t data_len, int ttl);
+
+/*
+ * Key for a GET or HEAD request: method, scheme, host, path, query and the
+ * vary headers.
+ * Returns the key length, or -1 if the request is not cacheable.
+ */
+ssize_t resp_cache_key(const ScgiHeaders *headers, const RespCacheVary *vary,
+                       char *key, size_t size);
+
+/* seconds a response with this Cache-Control may be kept, or -1 */
+int resp_cache_ttl(const char *cache_control, size_t len);
+
+/* whether a Cache-Control lets one user's response go to another at all */
+int resp_cache_shareable(const char *cache_control, size_t len);
+
+/* whether every header named by a response's Vary is part of the key */
+int resp_cache_vary_covered(const RespCacheVary *vary, const char *value, size_t len);
+
+int resp_cache_vary_add(RespCacheVary *vary, const char *header);
+void resp_cache_vary_free(RespCacheVary *vary);
+
+#endif
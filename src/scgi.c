@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <string.h>
+
+#include "scgi.h"
+
+#define MAX_LENGTH_DIGITS       (10)
+
+static int fail(ScgiHeaders *headers, const char *error) {
+    headers->count = 0;
+    headers->error = error;
+    return -1;
+}
+
+/*
+ * Read the netstring length prefix, "<digits>:".
+ */
+static ssize_t read_length(PieBuffer *buffer, ScgiHeaders *headers, size_t max_size) {
+    ssize_t loc;
+    size_t size = 0;
+    char *p;
+    ssize_t i;
+
+    /* bounded, so junk can't make us buffer up to max_size looking for it */
+    loc = pie_buffer_findchar_within(buffer, ':', MAX_LENGTH_DIGITS + 1);
+    if(loc < 0 && pie_buffer_size(buffer) > MAX_LENGTH_DIGITS)
+        return fail(headers, "Bad SCGI header size");
+    if(loc < 0)
+        return fail(headers, "Problems getting SCGI header size");
+    if(loc == 0)
+        return fail(headers, "Bad SCGI header size");
+
+    if(pie_buffer_getptr(buffer, &p, loc + 1) != loc + 1)
+        return fail(headers, "Problems getting SCGI header size");
+
+    for(i = 0; i < loc; i++) {
+        if(p[i] < '0' || p[i] > '9')
+            return fail(headers, "Bad SCGI header size");
+        size = size * 10 + (p[i] - '0');
+    }
+
+    if(size > max_size)
+        return fail(headers, "SCGI headers too large");
+
+    return size;
+}
+
+/*
+ * Parse the whole netstring in one pass, leaving the buffer positioned at
+ * the start of the request body.
+ */
+int scgi_read_headers(PieBuffer *buffer, ScgiHeaders *headers, size_t max_size) {
+    ssize_t size, got;
+    char *block, *itr, *end, *nul;
+    ScgiHeader *h;
+
+    headers->count = 0;
+    headers->error = NULL;
+    headers->block = NULL;
+    headers->block_size = 0;
+
+    size = read_length(buffer, headers, max_size);
+    if(size < 0)
+        return -1;
+
+    /*
+     * Some servers count the comma in the length.  A well formed block always
+     * ends in a NUL, so look at the declared bytes first and only wait for
+     * one more if the comma isn't among them; otherwise a bodyless request
+     * would sit here until the peer half-closes.
+     */
+    if(size > 0) {
+        got = pie_buffer_getptr(buffer, &block, size);
+        if(got < size)
+            return fail(headers, "Problems getting SCGI headers");
+        if(block[size-1] == ',') {
+            size--;
+            goto parse;
+        }
+        pie_buffer_unget(buffer, size);
+    }
+
+    /* grab the trailing comma too, so the block is never touched again */
+    got = pie_buffer_getptr(buffer, &block, size + 1);
+    if(got < size + 1)
+        return fail(headers, "Problems getting SCGI headers");
+    if(block[size] != ',')
+        return fail(headers, "SCGI headers missing trailing comma");
+
+parse:
+    headers->block = block;
+    headers->block_size = size;
+
+    itr = block;
+    end = block + size;
+    while(itr < end) {
+        if(headers->count == SCGI_MAX_HEADERS)
+            return fail(headers, "Too many SCGI headers");
+        h = &headers->items[headers->count];
+
+        nul = memchr(itr, '\0', end - itr);
+        if(nul == NULL || nul == itr)
+            return fail(headers, "Bad SCGI header name");
+        h->name = itr;
+        h->name_len = nul - itr;
+        itr = nul + 1;
+
+        nul = memchr(itr, '\0', end - itr);
+        if(nul == NULL)
+            return fail(headers, "Bad SCGI header value");
+        h->value = itr;
+        h->value_len = nul - itr;
+        itr = nul + 1;
+
+        headers->count++;
+    }
+
+    return 0;
+}
+
+const ScgiHeader *scgi_find_header(const ScgiHeaders *headers, const char *name) {
+    size_t len = strlen(name);
+    int i;
+
+    for(i = 0; i < headers->count; i++) {
+        const ScgiHeader *h = &headers->items[i];
+        if(h->name_len == len && memcmp(h->name, name, len) == 0)
+            return h;
+    }
+    return NULL;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PIE_SCGI_H
+#define PIE_SCGI_H
+
+#include <sys/types.h>
+
+#include "buffer.h"
+
+#define SCGI_MAX_HEADER_SIZE    (65536)
+#define SCGI_MAX_HEADERS        (256)
+
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} ScgiHeader;
+
+/*
+ * Slices point into the request buffer, and stay valid only until the
+ * buffer is next touched.
+ */
+typedef struct {
+    ScgiHeader items[SCGI_MAX_HEADERS];
+    int count;
+    const char *block;
+    size_t block_size;
+    const char *error;
+} ScgiHeaders;
+
+int scgi_read_headers(PieBuffer *buffer, ScgiHeaders *headers, size_t max_size);
+
+/* values are always followed by a NUL, so can be used as C strings */
+const ScgiHeader *scgi_find_header(const ScgiHeaders *headers, const char *name);
+
+#endif
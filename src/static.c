@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "static.h"
+
+typedef struct {
+    const char *ext;
+    const char *type;
+} ContentType;
+
+static const ContentType content_types[] = {
+    { "html",  "text/html; charset=utf-8" },
+    { "htm",   "text/html; charset=utf-8" },
+    { "css",   "text/css; charset=utf-8" },
+    { "js",    "text/javascript; charset=utf-8" },
+    { "mjs",   "text/javascript; charset=utf-8" },
+    { "json",  "application/json" },
+    { "map",   "application/json" },
+    { "txt",   "text/plain; charset=utf-8" },
+    { "csv",   "text/csv; charset=utf-8" },
+    { "xml",   "application/xml" },
+    { "svg",   "image/svg+xml" },
+    { "png",   "image/png" },
+    { "jpg",   "image/jpeg" },
+    { "jpeg",  "image/jpeg" },
+    { "gif",   "image/gif" },
+    { "webp",  "image/webp" },
+    { "avif",  "image/avif" },
+    { "ico",   "image/vnd.microsoft.icon" },
+    { "woff",  "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf",   "font/ttf" },
+    { "otf",   "font/otf" },
+    { "wasm",  "application/wasm" },
+    { "pdf",   "application/pdf" },
+    { "zip",   "application/zip" },
+    { "gz",    "application/gzip" },
+    { "mp3",   "audio/mpeg" },
+    { "ogg",   "audio/ogg" },
+    { "wav",   "audio/wav" },
+    { "mp4",   "video/mp4" },
+    { "webm",  "video/webm" },
+    { NULL, NULL }
+};
+
+static const char *day_names[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *month_names[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/*
+ * Mounts
+ */
+
+void static_files_init(StaticFiles *files, FdCache *cache) {
+    files->mounts = NULL;
+    files->count = 0;
+    files->cache = cache;
+}
+
+int static_files_add(StaticFiles *files, const char *prefix, const char *dir) {
+    StaticMount *mounts;
+    StaticMount *m;
+    size_t len = strlen(prefix);
+    struct stat st;
+    int dirfd;
+
+    while(len > 0 && prefix[len-1] == '/')
+        len--;
+
+    dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirfd < 0)
+        return -1;
+    if(fstat(dirfd, &st) < 0) {
+        int saved = errno;
+        close(dirfd);
+        errno = saved;
+        return -1;
+    }
+
+    mounts = realloc(files->mounts, (files->count + 1) * sizeof(StaticMount));
+    if(mounts == NULL) {
+        close(dirfd);
+        errno = ENOMEM;
+        return -1;
+    }
+    files->mounts = mounts;
+
+    m = &mounts[files->count];
+    m->prefix = strndup(prefix, len);
+    if(m->prefix == NULL) {
+        close(dirfd);
+        errno = ENOMEM;
+        return -1;
+    }
+    m->prefix_len = len;
+    m->dirfd = dirfd;
+    m->dir_dev = st.st_dev;
+    m->dir_ino = st.st_ino;
+    files->count++;
+
+    return 0;
+}
+
+void static_files_free(StaticFiles *files) {
+    int i;
+
+    for(i = 0; i < files->count; i++) {
+        free(files->mounts[i].prefix);
+        close(files->mounts[i].dirfd);
+    }
+    free(files->mounts);
+    files->mounts = NULL;
+    files->count = 0;
+}
+
+/*
+ * Request Path
+ */
+
+static int hexval(char c) {
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Decoded path of the request, preferring REQUEST_URI as front-ends
+ * disagree on how to split SCRIPT_NAME and PATH_INFO.
+ */
+static int request_path(const ScgiHeaders *headers, char *path, size_t size) {
+    const ScgiHeader *h;
+    size_t len = 0;
+
+    h = scgi_find_header(headers, "REQUEST_URI");
+    if(h != NULL) {
+        const char *p = h->value;
+        const char *end = h->value + h->value_len;
+
+        for(; p < end && *p != '?' && *p != '#'; p++) {
+            char c = *p;
+
+            if(c == '%') {
+                int hi, lo;
+                if(end - p < 3 || (hi = hexval(p[1])) < 0 || (lo = hexval(p[2])) < 0)
+                    return -1;
+                c = (char)(hi * 16 + lo);
+                p += 2;
+            }
+            if(c == '\0' || len + 1 >= size)
+                return -1;
+            path[len++] = c;
+        }
+    } else {
+        const ScgiHeader *script = scgi_find_header(headers, "SCRIPT_NAME");
+        const ScgiHeader *info = scgi_find_header(headers, "PATH_INFO");
+        size_t script_len = script ? script->value_len : 0;
+        size_t info_len = info ? info->value_len : 0;
+
+        if(script_len + info_len + 1 > size)
+            return -1;
+        if(script_len)
+            memcpy(path, script->value, script_len);
+        if(info_len)
+            memcpy(path + script_len, info->value, info_len);
+        len = script_len + info_len;
+    }
+
+    path[len] = '\0';
+    return 0;
+}
+
+/* never leave the mounted directory */
+static int safe_relative(const char *rel) {
+    const char *seg = rel;
+
+    for(;;) {
+        const char *slash = strchr(seg, '/');
+        size_t seglen = slash ? (size_t)(slash - seg) : strlen(seg);
+
+        if(seglen == 2 && seg[0] == '.' && seg[1] == '.')
+            return 0;
+        if(slash == NULL)
+            return 1;
+        seg = slash + 1;
+    }
+}
+
+static StaticMount *find_mount(StaticFiles *files, const char *path) {
+    StaticMount *best = NULL;
+    int i;
+
+    for(i = 0; i < files->count; i++) {
+        StaticMount *m = &files->mounts[i];
+
+        if(strncmp(path, m->prefix, m->prefix_len) != 0 || path[m->prefix_len] != '/')
+            continue;
+        if(best == NULL || m->prefix_len > best->prefix_len)
+            best = m;
+    }
+    return best;
+}
+
+/*
+ * Headers
+ */
+
+static const char *content_type(const char *rel) {
+    const char *slash = strrchr(rel, '/');
+    const char *dot = strrchr(slash ? slash : rel, '.');
+    const ContentType *ct;
+
+    if(dot != NULL) {
+        for(ct = content_types; ct->ext != NULL; ct++) {
+            if(strcasecmp(dot + 1, ct->ext) == 0)
+                return ct->type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+static void format_http_date(char *buf, size_t size, time_t t) {
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    snprintf(buf, size, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+             day_names[tm.tm_wday], tm.tm_mday, month_names[tm.tm_mon],
+             tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+static int parse_http_date(const char *s, time_t *t) {
+    struct tm tm;
+    char month[4];
+    int i;
+
+    memset(&tm, 0, sizeof(tm));
+    if(sscanf(s, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, month,
+              &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return -1;
+
+    for(i = 0; i < 12; i++) {
+        if(strcmp(month, month_names[i]) == 0)
+            break;
+    }
+    if(i == 12)
+        return -1;
+
+    tm.tm_mon = i;
+    tm.tm_year -= 1900;
+    *t = timegm(&tm);
+    return 0;
+}
+
+/* weak comparison, as If-None-Match calls for */
+static int etag_matches(const char *list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = list;
+
+    while(*p) {
+        const char *end;
+
+        while(*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if(*p == '*')
+            return 1;
+        if(p[0] == 'W' && p[1] == '/')
+            p += 2;
+
+        end = strchr(p, ',');
+        if(end == NULL)
+            end = p + strlen(p);
+        while(end > p && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+
+        if((size_t)(end - p) == etag_len && memcmp(p, etag, etag_len) == 0)
+            return 1;
+
+        p = end;
+        while(*p && *p != ',')
+            p++;
+    }
+    return 0;
+}
+
+static int not_modified(const ScgiHeaders *headers, const char *etag, time_t mtime) {
+    const ScgiHeader *h;
+    time_t since;
+
+    /* If-None-Match wins when both are given */
+    h = scgi_find_header(headers, "HTTP_IF_NONE_MATCH");
+    if(h != NULL)
+        return etag_matches(h->value, etag);
+
+    h = scgi_find_header(headers, "HTTP_IF_MODIFIED_SINCE");
+    if(h != NULL && parse_http_date(h->value, &since) == 0)
+        return mtime <= since;
+
+    return 0;
+}
+
+static void append_header(PieBuffer *out, const char *name, const char *value) {
+    pie_buffer_append(out, name, strlen(name));
+    pie_buffer_append(out, ": ", 2);
+    pie_buffer_append(out, value, strlen(value));
+    pie_buffer_append(out, "\r\n", 2);
+}
+
+/*
+ * Respond
+ */
+
+static int open_file(StaticFiles *files, StaticMount *mount, const char *rel,
+                     StaticFile *file, struct stat *st) {
+    file->entry = NULL;
+
+    if(files->cache != NULL && fd_cache_enabled(files->cache)) {
+        file->entry = fd_cache_open(files->cache, mount->dirfd, mount->dir_dev,
+                                    mount->dir_ino, rel);
+        if(file->entry == NULL)
+            return -1;
+        file->fd = file->entry->fd;
+        *st = file->entry->st;
+        return 0;
+    }
+
+    file->fd = fd_open_beneath(mount->dirfd, rel);
+    if(file->fd < 0)
+        return -1;
+    if(fstat(file->fd, st) < 0) {
+        close(file->fd);
+        return -1;
+    }
+    return 0;
+}
+
+void static_files_release(StaticFiles *files, StaticFile *file) {
+    if(file->entry != NULL)
+        fd_cache_release(files->cache, file->entry);
+    else if(file->fd >= 0)
+        close(file->fd);
+
+    file->fd = -1;
+    file->entry = NULL;
+}
+
+int static_files_respond(StaticFiles *files, const ScgiHeaders *headers,
+                         PieBuffer *out, StaticFile *file) {
+    char path[STATIC_MAX_PATH];
+    char etag[64], modified[64], length[32];
+    const ScgiHeader *method;
+    StaticMount *mount;
+    const char *rel;
+    struct stat st;
+    int head_only;
+
+    method = scgi_find_header(headers, "REQUEST_METHOD");
+    if(method == NULL)
+        return 0;
+    if(strcmp(method->value, "GET") == 0)
+        head_only = 0;
+    else if(strcmp(method->value, "HEAD") == 0)
+        head_only = 1;
+    else
+        return 0;
+
+    if(request_path(headers, path, sizeof(path)) < 0)
+        return 0;
+
+    mount = find_mount(files, path);
+    if(mount == NULL)
+        return 0;
+
+    rel = path + mount->prefix_len;
+    while(*rel == '/')
+        rel++;
+    if(*rel == '\0' || !safe_relative(rel))
+        return 0;
+
+    if(open_file(files, mount, rel, file, &st) < 0)
+        return 0;
+    if(!S_ISREG(st.st_mode)) {
+        static_files_release(files, file);
+        return 0;
+    }
+
+    snprintf(etag, sizeof(etag), "\"%llx-%llx\"",
+             (unsigned long long)st.st_mtime, (unsigned long long)st.st_size);
+    format_http_date(modified, sizeof(modified), st.st_mtime);
+
+    if(not_modified(headers, etag, st.st_mtime)) {
+        pie_buffer_append(out, "Status: 304 Not Modified\r\n", 26);
+        head_only = 1;
+    } else {
+        snprintf(length, sizeof(length), "%llu", (unsigned long long)st.st_size);
+        pie_buffer_append(out, "Status: 200 OK\r\n", 16);
+        append_header(out, "Content-Type", content_type(rel));
+        append_header(out, "Content-Length", length);
+    }
+    append_header(out, "Last-Modified", modified);
+    append_header(out, "ETag", etag);
+    pie_buffer_append(out, "\r\n", 2);
+
+    if(head_only || st.st_size == 0)
+        static_files_release(files, file);
+
+    file->size = st.st_size;
+    return 1;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PIE_STATIC_H
+#define PIE_STATIC_H
+
+#include <sys/types.h>
+
+#include "buffer.h"
+#include "fdcache.h"
+#include "scgi.h"
+
+#define STATIC_MAX_PATH     (4096)
+
+typedef struct {
+    char *prefix;           /* without trailing slash, so "/" is "" */
+    size_t prefix_len;
+    int dirfd;
+    dev_t dir_dev;          /* identify the directory to the fd cache */
+    ino_t dir_ino;
+} StaticMount;
+
+typedef struct {
+    StaticMount *mounts;
+    int count;
+    FdCache *cache;         /* may be NULL */
+} StaticFiles;
+
+typedef struct {
+    int fd;                 /* -1 when there is no body to send */
+    off_t size;
+    FdCacheEntry *entry;    /* when fd came from the cache */
+} StaticFile;
+
+void static_files_init(StaticFiles *files, FdCache *cache);
+int static_files_add(StaticFiles *files, const char *prefix, const char *dir);
+void static_files_free(StaticFiles *files);
+
+/*
+ * Answer the request from a mounted directory if it names a regular file
+ * there.  On success, returns 1 with the response headers appended to out,
+ * and file->fd (if not -1) left for the caller to send, then hand back with
+ * static_files_release().  Returns 0 when the request should go to the
+ * application instead.
+ */
+int static_files_respond(StaticFiles *files, const ScgiHeaders *headers,
+                         PieBuffer *out, StaticFile *file);
+void static_files_release(StaticFiles *files, StaticFile *file);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "workerpool.h"
+
+int worker_pool_init(WorkerPool *pool, const int *fds, int nfds, int min, int max, int idle_ms) {
+    struct timeval tv;
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->min = min < 1 ? 1 : min;
+    pool->max = max < pool->min ? pool->min : max;
+    pool->idle_ms = idle_ms < 1 ? 1 : idle_ms;
+
+    pool->fds = malloc(sizeof(int) * (nfds > 0 ? nfds : 1));
+    if(pool->fds == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(pool->fds, fds, sizeof(int) * nfds);
+    pool->nfds = nfds;
+
+    /* so an idle worker's accept() gives up now and then */
+    tv.tv_sec = pool->idle_ms / 1000;
+    tv.tv_usec = (pool->idle_ms % 1000) * 1000;
+    for(i = 0; i < nfds; i++) {
+        if(setsockopt(fds[i], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+            free(pool->fds);
+            pool->fds = NULL;
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    return 0;
+}
+
+void worker_pool_free(WorkerPool *pool) {
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->fds);
+    pool->fds = NULL;
+}
+
+/* are connections waiting in the backlog of any listen socket */
+static int worker_pool_pending(WorkerPool *pool) {
+    struct pollfd pfds[16];
+    int i, n;
+
+    for(i = 0; i < pool->nfds; i += n) {
+        int j;
+
+        n = pool->nfds - i;
+        if(n > 16)
+            n = 16;
+        for(j = 0; j < n; j++) {
+            pfds[j].fd = pool->fds[i + j];
+            pfds[j].events = POLLIN;
+            pfds[j].revents = 0;
+        }
+        if(poll(pfds, n, 0) > 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* with the lock held */
+static int worker_pool_starved(WorkerPool *pool) {
+    return pool->busy >= pool->threads && pool->threads < pool->max &&
+           worker_pool_pending(pool);
+}
+
+static void worker_pool_take(WorkerPool *pool) {
+    pool->threads++;
+    if(pool->threads > pool->peak)
+        pool->peak = pool->threads;
+    pool->spawned++;
+}
+
+int worker_pool_reserve(WorkerPool *pool) {
+    int result = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->threads < pool->max) {
+        worker_pool_take(pool);
+        result = 1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return result;
+}
+
+int worker_pool_wait(WorkerPool *pool, int timeout_ms) {
+    struct timespec deadline;
+    int result = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while(!pool->wanted && !pool->quitting) {
+        if(pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    if(pool->quitting) {
+        result = -1;
+    } else if(pool->wanted || worker_pool_starved(pool)) {
+        /* workers only look when they start a request; this catches the rest */
+        pool->wanted = 0;
+        if(pool->threads < pool->max) {
+            worker_pool_take(pool);
+            result = 1;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return result;
+}
+
+void worker_pool_halt(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quitting = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void worker_pool_busy(WorkerPool *pool, int fd) {
+    struct timeval tv = { 0, 0 };
+
+    /* TCP connections inherit the accept timeout, which isn't meant for them */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy++;
+    if(!pool->wanted && worker_pool_starved(pool)) {
+        pool->wanted = 1;
+        pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void worker_pool_idle(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->busy--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int worker_pool_retire(WorkerPool *pool) {
+    int result = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->threads > pool->min) {
+        pool->threads--;
+        pool->retired++;
+        result = 1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return result;
+}
+
+void worker_pool_leave(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->threads--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void worker_pool_get_stats(WorkerPool *pool, WorkerPoolStats *stats) {
+    pthread_mutex_lock(&pool->lock);
+    stats->threads = pool->threads;
+    stats->busy = pool->busy;
+    stats->peak = pool->peak;
+    stats->spawned = pool->spawned;
+    stats->retired = pool->retired;
+    pthread_mutex_unlock(&pool->lock);
+}
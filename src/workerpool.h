@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PIE_WORKERPOOL_H
+#define PIE_WORKERPOOL_H
+
+#include <pthread.h>
+
+/*
+ * Counts the worker threads on a set of listen sockets, and how many are
+ * busy with a request, so the pool can grow while every one of them is
+ * busy and connections are left waiting, and shrink again when they sit
+ * idle.
+ *
+ * Workers count themselves busy and idle around each request.  Accepting
+ * times out after idle_ms (SO_RCVTIMEO on the listen sockets), when a
+ * worker may retire if there are more than min.  Whoever manages the
+ * threads waits in worker_pool_wait() to be told to start another.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int *fds;
+    int nfds;
+    int min, max;
+    int idle_ms;
+
+    int threads;                /* started, or about to be, and not retired */
+    int busy;
+    int wanted;                 /* a worker saw connections waiting on it */
+    int quitting;
+
+    int peak;
+    unsigned long long spawned;
+    unsigned long long retired;
+} WorkerPool;
+
+typedef struct {
+    int threads;
+    int busy;
+    int peak;
+    unsigned long long spawned;
+    unsigned long long retired;
+} WorkerPoolStats;
+
+int worker_pool_init(WorkerPool *pool, const int *fds, int nfds, int min, int max, int idle_ms);
+void worker_pool_free(WorkerPool *pool);
+
+/* counts a thread about to be started, 0 if already at max */
+int worker_pool_reserve(WorkerPool *pool);
+
+/*
+ * Blocks up to timeout_ms for another thread to be wanted, and if so
+ * reserves it and returns 1.  0 on timeout, -1 once halted.
+ */
+int worker_pool_wait(WorkerPool *pool, int timeout_ms);
+void worker_pool_halt(WorkerPool *pool);
+
+/* around each request in the accept loop, fd being the accepted connection */
+void worker_pool_busy(WorkerPool *pool, int fd);
+void worker_pool_idle(WorkerPool *pool);
+
+/* after accept timed out, 1 if this thread should leave (and is no longer counted) */
+int worker_pool_retire(WorkerPool *pool);
+
+/* a worker stopped for some other reason, such as an error */
+void worker_pool_leave(WorkerPool *pool);
+
+void worker_pool_get_stats(WorkerPool *pool, WorkerPoolStats *stats);
+
+#endif
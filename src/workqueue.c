@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "workqueue.h"
+
+#define MIN_CAPACITY    (2)
+
+/*
+ * Parking
+ */
+
+#ifdef __linux__
+
+static void park(atomic_int *word, int seen) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void unpark(atomic_int *word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#else
+
+/* no futex, so nap briefly and look again */
+static void park(atomic_int *word, int seen) {
+    struct timespec ts = { 0, 1000000 };
+
+    if(atomic_load(word) == seen)
+        nanosleep(&ts, NULL);
+}
+
+static void unpark(atomic_int *word, int count) {
+}
+
+#endif
+
+static void wake(WorkQueue *q, int count) {
+    atomic_fetch_add(&q->wake_seq, 1);
+    unpark(&q->wake_seq, count);
+}
+
+/*
+ * Queue
+ */
+
+int work_queue_init(WorkQueue *q, size_t capacity) {
+    size_t size = MIN_CAPACITY, i;
+
+    while(size < capacity)
+        size <<= 1;
+
+    q->cells = malloc(size * sizeof(WorkQueueCell));
+    if(q->cells == NULL)
+        return -1;
+    for(i = 0; i < size; i++) {
+        atomic_init(&q->cells[i].seq, i);
+        q->cells[i].item = NULL;
+    }
+    q->mask = size - 1;
+
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->wake_seq, 0);
+    atomic_init(&q->sleepers, 0);
+    atomic_init(&q->pushed, 0);
+    atomic_init(&q->popped, 0);
+    atomic_init(&q->full, 0);
+    atomic_init(&q->max_depth, 0);
+
+    return 0;
+}
+
+void work_queue_free(WorkQueue *q) {
+    free(q->cells);
+    q->cells = NULL;
+}
+
+int work_queue_push(WorkQueue *q, void *item) {
+    WorkQueueCell *cell;
+    size_t pos, seq, depth, max;
+    intptr_t dif;
+
+    pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for(;;) {
+        cell = &q->cells[pos & q->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        dif = (intptr_t)seq - (intptr_t)pos;
+
+        if(dif == 0) {
+            if(atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(dif < 0) {
+            /* still holding last lap's item */
+            atomic_fetch_add_explicit(&q->full, 1, memory_order_relaxed);
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+
+    cell->item = item;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&q->pushed, 1, memory_order_relaxed);
+    depth = work_queue_depth(q);
+    max = atomic_load_explicit(&q->max_depth, memory_order_relaxed);
+    while(depth > max && !atomic_compare_exchange_weak_explicit(&q->max_depth, &max, depth,
+                                                                memory_order_relaxed,
+                                                                memory_order_relaxed))
+        ;
+
+    /* pairs with the fence in work_queue_pop_wait() */
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&q->sleepers, memory_order_relaxed) > 0)
+        wake(q, 1);
+
+    return 0;
+}
+
+void *work_queue_pop(WorkQueue *q) {
+    WorkQueueCell *cell;
+    size_t pos, seq;
+    intptr_t dif;
+    void *item;
+
+    pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for(;;) {
+        cell = &q->cells[pos & q->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if(dif == 0) {
+            if(atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(dif < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+
+    item = cell->item;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    atomic_fetch_add_explicit(&q->popped, 1, memory_order_relaxed);
+
+    return item;
+}
+
+void *work_queue_pop_wait(WorkQueue *q, const int *quitting) {
+    void *item;
+    int seen;
+
+    for(;;) {
+        item = work_queue_pop(q);
+        if(item != NULL)
+            return item;
+
+        seen = atomic_load(&q->wake_seq);
+        if(*(volatile const int *)quitting)
+            return NULL;
+
+        /* say we're going to sleep, then look once more before we do */
+        atomic_fetch_add(&q->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        item = work_queue_pop(q);
+        if(item == NULL && !*(volatile const int *)quitting)
+            park(&q->wake_seq, seen);
+
+        atomic_fetch_sub(&q->sleepers, 1);
+        if(item != NULL)
+            return item;
+    }
+}
+
+void work_queue_wake_all(WorkQueue *q) {
+    wake(q, INT_MAX);
+}
+
+size_t work_queue_depth(WorkQueue *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    return head > tail ? head - tail : 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2013-2015 Robin Schoonover
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PIE_WORKQUEUE_H
+#define PIE_WORKQUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct {
+    atomic_size_t seq;
+    void *item;
+} WorkQueueCell;
+
+/*
+ * Bounded lock-free FIFO of pointers, for any number of producers and
+ * consumers.  Each cell carries a sequence number saying whether it is
+ * ready to be filled or emptied for the current lap around the ring, so
+ * push and pop only contend on their own index.  Consumers with nothing
+ * to do park on a futex, and producers only make a syscall to wake them
+ * when someone is actually parked.
+ */
+typedef struct {
+    WorkQueueCell *cells;
+    size_t mask;
+
+    /* padded so producers and consumers don't share cache lines */
+    char pad0[64];
+    atomic_size_t head;                 /* next to push */
+    char pad1[64];
+    atomic_size_t tail;                 /* next to pop */
+    char pad2[64];
+
+    atomic_int wake_seq;                /* futex word, bumped to wake */
+    atomic_int sleepers;
+
+    /* counters */
+    atomic_ullong pushed;
+    atomic_ullong popped;
+    atomic_ullong full;                 /* pushes refused for lack of room */
+    atomic_size_t max_depth;
+} WorkQueue;
+
+/* capacity is rounded up to a power of two */
+int work_queue_init(WorkQueue *q, size_t capacity);
+void work_queue_free(WorkQueue *q);
+
+/* returns -1 if full */
+int work_queue_push(WorkQueue *q, void *item);
+
+/* returns NULL if empty */
+void *work_queue_pop(WorkQueue *q);
+
+/* blocks until there is an item, or NULL once *quitting is set */
+void *work_queue_pop_wait(WorkQueue *q, const int *quitting);
+
+/* wake all parked consumers, so they look at *quitting again */
+void work_queue_wake_all(WorkQueue *q);
+
+size_t work_queue_depth(WorkQueue *q);
+
+#endif